@@ -17,6 +17,8 @@ STD_EXT = Extension(
         "src/py_hfst_ospell/hfst-ol.cc",
         "src/py_hfst_ospell/ospell.cc",
         "src/py_hfst_ospell/ZHfstOspeller.cc",
+        "src/py_hfst_ospell/BatchSpeller.cc",
+        "src/py_hfst_ospell/SuggestionStore.cc",
         "src/py_hfst_ospell/ZHfstOspellerXmlMetadata.cc"
     ],
     include_dirs=[
@@ -0,0 +1,261 @@
+/* -*- Mode: C++ -*- */
+// Copyright 2010 University of Helsinki
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+
+using std::string;
+
+// local
+#include "BatchSpeller.h"
+
+namespace hfst_ospell
+  {
+
+static const uint64_t RANGE_BITS = 32;
+static const uint64_t RANGE_MASK = (uint64_t(1) << RANGE_BITS) - 1;
+
+static inline uint64_t
+pack_range(uint64_t begin, uint64_t end)
+  {
+    return (begin << RANGE_BITS) | end;
+  }
+
+static inline size_t
+range_begin(uint64_t range)
+  {
+    return static_cast<size_t>(range >> RANGE_BITS);
+  }
+
+static inline size_t
+range_end(uint64_t range)
+  {
+    return static_cast<size_t>(range & RANGE_MASK);
+  }
+
+static unsigned int
+default_threads(unsigned int threads)
+  {
+    if (threads == 0)
+      {
+        threads = std::thread::hardware_concurrency();
+      }
+    return (threads == 0) ? 1 : threads;
+  }
+
+BatchSpeller::BatchSpeller(ZHfstOspeller& speller, unsigned int threads) :
+    speller_(speller),
+    threads_(default_threads(threads)),
+    wordforms_(0),
+    ranges_(threads_)
+  {}
+
+unsigned int
+BatchSpeller::get_threads() const
+  {
+    return threads_;
+  }
+
+std::vector<bool>
+BatchSpeller::spell(const std::vector<string>& wordforms)
+  {
+    std::vector<bool> rv(wordforms.size(), false);
+    if (speller_.can_spell_ && (speller_.current_speller_ != 0))
+      {
+        wordforms_ = &wordforms;
+        spelled_.assign(wordforms.size(), 0);
+        run(speller_.current_speller_, &BatchSpeller::spell_one);
+        for (size_t i = 0; i < wordforms.size(); ++i)
+          {
+            rv[i] = (spelled_[i] != 0);
+          }
+        spelled_.clear();
+      }
+    return rv;
+  }
+
+std::vector<CorrectionQueue>
+BatchSpeller::suggest(const std::vector<string>& wordforms)
+  {
+    std::vector<CorrectionQueue> rv;
+    if (speller_.can_correct_ && (speller_.current_sugger_ != 0))
+      {
+        wordforms_ = &wordforms;
+        settings_ = speller_.search_settings();
+        suggested_.assign(wordforms.size(), CorrectionQueue());
+        run(speller_.current_sugger_, &BatchSpeller::suggest_one);
+        rv.swap(suggested_);
+      }
+    else
+      {
+        rv.resize(wordforms.size());
+      }
+    return rv;
+  }
+
+void
+BatchSpeller::spell_one(BatchSpeller& batch, SearchContext& context,
+                        std::vector<char>& buffer, size_t index)
+  {
+    const string& wordform = (*batch.wordforms_)[index];
+    buffer.assign(wordform.begin(), wordform.end());
+    buffer.push_back('\0');
+    batch.spelled_[index] = context.check(&buffer[0]) ? 1 : 0;
+  }
+
+void
+BatchSpeller::suggest_one(BatchSpeller& batch, SearchContext& context,
+                          std::vector<char>& buffer, size_t index)
+  {
+    // the batch keeps the threads busy already
+    context.parallel_threads = 1;
+    Deadline deadline = deadline_in(batch.settings_.time_cutoff);
+    bool truncated;
+    batch.suggested_[index] = batch.speller_.correct_in(
+        &context, batch.settings_, (*batch.wordforms_)[index], buffer,
+        deadline, truncated);
+  }
+
+void
+BatchSpeller::run(Speller* speller, Task task)
+  {
+    size_t count = wordforms_->size();
+    if (count > RANGE_MASK)
+      {
+        throw std::length_error("too many word forms in one batch");
+      }
+    size_t workers = std::min<size_t>(threads_, count);
+    // deal out equal ranges; workers past the last word get empty ones
+    for (size_t i = 0; i < ranges_.size(); ++i)
+      {
+        if (i < workers)
+          {
+            ranges_[i].store(pack_range(count * i / workers,
+                                        count * (i + 1) / workers));
+          }
+        else
+          {
+            ranges_[i].store(pack_range(0, 0));
+          }
+      }
+    failure_ = std::exception_ptr();
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < workers; ++i)
+      {
+        pool.push_back(std::thread(&BatchSpeller::work, this,
+                                   speller, task, i));
+      }
+    // the calling thread is the first worker
+    if (workers > 0)
+      {
+        work(speller, task, 0);
+      }
+    for (size_t i = 0; i < pool.size(); ++i)
+      {
+        pool[i].join();
+      }
+    wordforms_ = 0;
+    if (failure_)
+      {
+        std::exception_ptr failure = failure_;
+        failure_ = std::exception_ptr();
+        std::rethrow_exception(failure);
+      }
+  }
+
+void
+BatchSpeller::work(Speller* speller, Task task, size_t worker)
+  {
+    SearchContext* context = speller->acquire_context();
+    std::vector<char> buffer;
+    try
+      {
+        size_t index;
+        while (next_index(worker, index))
+          {
+            task(*this, *context, buffer, index);
+          }
+      }
+    catch (...)
+      {
+        std::lock_guard<std::mutex> lock(failure_mutex_);
+        if (!failure_)
+          {
+            failure_ = std::current_exception();
+          }
+        // drop own work so the other workers finish up quickly
+        for (size_t i = 0; i < ranges_.size(); ++i)
+          {
+            ranges_[i].store(pack_range(0, 0));
+          }
+      }
+    speller->release_context(context);
+  }
+
+bool
+BatchSpeller::next_index(size_t worker, size_t& index)
+  {
+    std::atomic<uint64_t>& own = ranges_[worker];
+    for (;;)
+      {
+        // take from the front of own range; thieves take from the back
+        uint64_t range = own.load();
+        while (range_begin(range) < range_end(range))
+          {
+            if (own.compare_exchange_weak(range,
+                                          pack_range(range_begin(range) + 1,
+                                                     range_end(range))))
+              {
+                index = range_begin(range);
+                return true;
+              }
+          }
+        // own range is empty: steal the back half of the largest one
+        size_t victim = ranges_.size();
+        size_t most = 0;
+        uint64_t victim_range = 0;
+        for (size_t i = 0; i < ranges_.size(); ++i)
+          {
+            uint64_t other = ranges_[i].load();
+            size_t left = range_end(other) - range_begin(other);
+            if (left > most)
+              {
+                victim = i;
+                most = left;
+                victim_range = other;
+              }
+          }
+        if (victim == ranges_.size())
+          {
+            // work only ever moves between ranges, so it's all done
+            return false;
+          }
+        size_t middle = range_end(victim_range) - (most + 1) / 2;
+        if (ranges_[victim].compare_exchange_strong(
+                victim_range,
+                pack_range(range_begin(victim_range), middle)))
+          {
+            // no one else writes an empty range, so plain store is enough
+            own.store(pack_range(middle, range_end(victim_range)));
+          }
+      }
+  }
+
+  } // namespace hfst_ospell
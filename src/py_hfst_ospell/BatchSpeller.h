@@ -0,0 +1,107 @@
+/* -*- Mode: C++ -*- */
+// Copyright 2010 University of Helsinki
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#ifndef HFST_OSPELL_BATCHSPELLER_H_
+#define HFST_OSPELL_BATCHSPELLER_H_
+
+#include "hfstol-stdafx.h"
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "ospell.h"
+#include "ZHfstOspeller.h"
+
+namespace hfst_ospell
+  {
+    //! @brief BatchSpeller checks and corrects lists of word forms with
+    //!        the automata of one ZHfstOspeller on a pool of threads.
+    //!
+    //! Each worker searches with search contexts of its own over the shared
+    //! automata. The word forms are dealt out to the workers in equal
+    //! ranges, and a worker that finishes its range steals half of the
+    //! largest range left, so a few expensive words don't keep the rest of
+    //! the pool waiting. Results come back in the order of the input.
+    class BatchSpeller
+      {
+        public:
+            //! @brief create batch speller for @a speller using @a threads
+            //!        workers, or one per hardware thread if 0.
+            //!
+            //! The speller must stay alive and unmodified while batches
+            //! are running, and one BatchSpeller runs one batch at a time.
+            OSPELL_API BatchSpeller(ZHfstOspeller& speller,
+                                    unsigned int threads = 0);
+            //! @brief check each of the given word forms, as
+            //!        ZHfstOspeller::spell() does
+            OSPELL_API std::vector<bool> spell(
+                const std::vector<std::string>& wordforms);
+            //! @brief construct corrections for each of the given word
+            //!        forms, as ZHfstOspeller::suggest() does
+            OSPELL_API std::vector<CorrectionQueue> suggest(
+                const std::vector<std::string>& wordforms);
+            //! @brief number of worker threads used per batch
+            OSPELL_API unsigned int get_threads() const;
+        private:
+            //! @brief what a worker does to one word form
+            typedef void (*Task)(BatchSpeller& batch, SearchContext& context,
+                                 std::vector<char>& buffer, size_t index);
+            //! @brief run @a task on every index of the batch, with search
+            //!        contexts from @a speller
+            void run(Speller* speller, Task task);
+            //! @brief the worker loop of thread number @a worker
+            void work(Speller* speller, Task task, size_t worker);
+            //! @brief claim the next index of own range or steal more
+            bool next_index(size_t worker, size_t& index);
+
+            static void spell_one(BatchSpeller& batch, SearchContext& context,
+                                  std::vector<char>& buffer, size_t index);
+            static void suggest_one(BatchSpeller& batch,
+                                    SearchContext& context,
+                                    std::vector<char>& buffer, size_t index);
+
+            //! @brief the speller whose automata and settings are used
+            ZHfstOspeller& speller_;
+            //! @brief number of workers per batch
+            unsigned int threads_;
+            //! @brief word forms of the running batch
+            const std::vector<std::string>* wordforms_;
+            //! @brief spell results of the running batch
+            std::vector<char> spelled_;
+            //! @brief suggest results of the running batch
+            std::vector<CorrectionQueue> suggested_;
+            //! @brief settings of the speller when the batch started
+            ZHfstOspeller::SearchSettings settings_;
+            //! @brief work left per worker, packed as begin << 32 | end
+            std::vector<std::atomic<uint64_t> > ranges_;
+            //! @brief first exception thrown by a worker, rethrown to caller
+            std::exception_ptr failure_;
+            //! @brief guards failure_
+            std::mutex failure_mutex_;
+      };
+
+  } // namespace hfst_ospell
+
+#endif // HFST_OSPELL_BATCHSPELLER_H_
+// vim: set ft=cpp.doxygen:
@@ -0,0 +1,183 @@
+/* -*- Mode: C++ -*- */
+// Copyright 2010 University of Helsinki
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#ifndef HFST_OSPELL_RESULTCACHE_H_
+#define HFST_OSPELL_RESULTCACHE_H_
+
+#include "hfstol-stdafx.h"
+
+#include <atomic>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace hfst_ospell
+  {
+    //! @brief Hit and miss counts of a ResultCache.
+    struct CacheCounters
+      {
+        unsigned long hits;
+        unsigned long misses;
+      };
+
+    //! @brief ResultCache keeps the most recently used results of some
+    //!        search by a string key, up to a number of entries.
+    //!
+    //! The entries are spread over shards by the hash of their key, each
+    //! shard with a lock and a least recently used order of its own, so
+    //! threads looking up different keys seldom wait for each other.
+    //! With a capacity of 0 the cache holds nothing and counts nothing.
+    template <class Value>
+    class ResultCache
+      {
+        public:
+            //! @brief create cache of @a capacity entries in @a shards
+            //!        shards
+            explicit ResultCache(size_t capacity = 0, size_t shards = 16) :
+                shards_(shards == 0 ? 1 : shards),
+                capacity_(0),
+                hits_(0),
+                misses_(0)
+              {
+                set_capacity(capacity);
+              }
+            //! @brief keep at most @a capacity entries, dropping the least
+            //!        recently used ones if there are more.
+            void set_capacity(size_t capacity)
+              {
+                for (size_t i = 0; i < shards_.size(); ++i)
+                  {
+                    Shard& shard = shards_[i];
+                    std::lock_guard<std::mutex> lock(shard.mutex);
+                    shard.capacity = capacity / shards_.size() +
+                        (i < capacity % shards_.size() ? 1 : 0);
+                    shard.trim();
+                  }
+                capacity_ = capacity;
+              }
+            //! @brief whether the cache can hold anything
+            bool enabled() const
+              {
+                return capacity_ != 0;
+              }
+            //! @brief copy the value of @a key into @a value if there is
+            //!        one, making it the most recently used.
+            bool find(const std::string& key, Value& value)
+              {
+                if (!enabled())
+                  {
+                    return false;
+                  }
+                Shard& shard = shard_of(key);
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                auto found = shard.index.find(key);
+                if (found == shard.index.end())
+                  {
+                    ++misses_;
+                    return false;
+                  }
+                shard.entries.splice(shard.entries.begin(), shard.entries,
+                                     found->second);
+                value = found->second->second;
+                ++hits_;
+                return true;
+              }
+            //! @brief store @a value as the value of @a key.
+            void insert(const std::string& key, const Value& value)
+              {
+                if (!enabled())
+                  {
+                    return;
+                  }
+                Shard& shard = shard_of(key);
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                auto found = shard.index.find(key);
+                if (found != shard.index.end())
+                  {
+                    found->second->second = value;
+                    shard.entries.splice(shard.entries.begin(),
+                                         shard.entries, found->second);
+                    return;
+                  }
+                shard.entries.push_front(std::make_pair(key, value));
+                shard.index[key] = shard.entries.begin();
+                shard.trim();
+              }
+            //! @brief drop all entries and reset the counters.
+            void clear()
+              {
+                for (auto& shard : shards_)
+                  {
+                    std::lock_guard<std::mutex> lock(shard.mutex);
+                    shard.entries.clear();
+                    shard.index.clear();
+                  }
+                hits_ = 0;
+                misses_ = 0;
+              }
+            //! @brief lookups that found or didn't find their key
+            CacheCounters get_counters() const
+              {
+                CacheCounters counters;
+                counters.hits = hits_;
+                counters.misses = misses_;
+                return counters;
+              }
+        private:
+            typedef std::list<std::pair<std::string, Value> > EntryList;
+
+            //! @brief one lock's worth of entries
+            struct Shard
+              {
+                std::mutex mutex;
+                //! @brief entries, most recently used first
+                EntryList entries;
+                //! @brief where each key is in entries
+                std::unordered_map<std::string,
+                                   typename EntryList::iterator> index;
+                size_t capacity;
+
+                Shard() : capacity(0) {}
+                //! @brief drop least recently used entries over capacity
+                void trim()
+                  {
+                    while (index.size() > capacity)
+                      {
+                        index.erase(entries.back().first);
+                        entries.pop_back();
+                      }
+                  }
+              };
+
+            Shard& shard_of(const std::string& key)
+              {
+                return shards_[std::hash<std::string>()(key) %
+                               shards_.size()];
+              }
+
+            std::vector<Shard> shards_;
+            std::atomic<size_t> capacity_;
+            std::atomic<unsigned long> hits_;
+            std::atomic<unsigned long> misses_;
+      };
+
+  } // namespace hfst_ospell
+
+#endif // HFST_OSPELL_RESULTCACHE_H_
+// vim: set ft=cpp.doxygen:
@@ -0,0 +1,406 @@
+/* -*- Mode: C++ -*- */
+// Copyright 2010 University of Helsinki
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <atomic>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#ifdef _WIN32
+#  include <io.h>
+#  include <process.h>
+#  define getpid _getpid
+#else
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+#ifndef O_BINARY
+#  define O_BINARY 0
+#endif
+
+using std::string;
+
+// local
+#include "SuggestionStore.h"
+
+namespace hfst_ospell
+  {
+
+// The file is a header followed by records, all in native byte order:
+//
+//   header: magic[8], version (u32), reserved (u32), checksum (u64)
+//   record: marker (u32), key length (u32), value length (u32),
+//           check (u32), key, value
+//
+// and a value is the corrections cheapest first, each as its length
+// (u32), its bytes and its weight. The check sums up the key and the value,
+// so a record torn by a crash or a racing writer is skipped, and scanning
+// goes on from the next marker after it.
+static const char STORE_MAGIC[8] = { 'O', 'S', 'P', 'E', 'L', 'L', 'S', 'S' };
+static const uint32_t STORE_VERSION = 1;
+static const size_t HEADER_SIZE = 24;
+static const uint32_t RECORD_MARKER = 0x52435053u;
+static const size_t RECORD_HEADER_SIZE = 16;
+// how many times to start over when other processes keep moving stores
+// for other automata in place before this one can open its own
+static const int OPEN_ATTEMPTS = 8;
+
+// FNV-1a
+static uint64_t
+fnv1a(const char* data, size_t length,
+      uint64_t h = 14695981039346656037ull)
+  {
+    for (size_t i = 0; i < length; ++i)
+      {
+        h ^= static_cast<unsigned char>(data[i]);
+        h *= 1099511628211ull;
+      }
+    return h;
+  }
+
+static uint32_t
+record_check(const char* key, size_t key_length,
+             const char* value, size_t value_length)
+  {
+    uint64_t h = fnv1a(value, value_length, fnv1a(key, key_length));
+    return static_cast<uint32_t>(h ^ (h >> 32));
+  }
+
+static inline uint32_t
+read_u32(const char* data)
+  {
+    uint32_t rv;
+    memcpy(&rv, data, sizeof(rv));
+    return rv;
+  }
+
+static inline void
+append_u32(string& out, uint32_t number)
+  {
+    out.append(reinterpret_cast<const char*>(&number), sizeof(number));
+  }
+
+static string
+encode_corrections(CorrectionQueue corrections)
+  {
+    string rv;
+    while (!corrections.empty())
+      {
+        const StringWeightPair& correction = corrections.top();
+        append_u32(rv, static_cast<uint32_t>(correction.first.size()));
+        rv.append(correction.first);
+        rv.append(reinterpret_cast<const char*>(&correction.second),
+                  sizeof(Weight));
+        corrections.pop();
+      }
+    return rv;
+  }
+
+static void
+decode_corrections(const char* value, size_t length,
+                   CorrectionQueue& corrections)
+  {
+    corrections = CorrectionQueue();
+    size_t pos = 0;
+    while (pos + sizeof(uint32_t) <= length)
+      {
+        size_t string_length = read_u32(value + pos);
+        pos += sizeof(uint32_t);
+        if (string_length + sizeof(Weight) > length - pos)
+          {
+            break;
+          }
+        Weight weight;
+        memcpy(&weight, value + pos + string_length, sizeof(Weight));
+        corrections.push(StringWeightPair(string(value + pos, string_length),
+                                          weight));
+        pos += string_length + sizeof(Weight);
+      }
+  }
+
+// A name next to @a path for a new file that no other process or store
+// writes to at the same time
+static string
+temporary_name(const string& path)
+  {
+    static std::atomic<unsigned long> counter(0);
+    return path + ".new." + std::to_string(static_cast<long>(getpid())) +
+        "." + std::to_string(counter++);
+  }
+
+// Whether the file open as @a fd starts with the header of a store for
+// @a checksum; @a size tells how long it is then
+static bool
+has_header(int fd, uint64_t checksum, size_t& size)
+  {
+    char header[HEADER_SIZE];
+#ifdef _WIN32
+    long end = _lseek(fd, 0, SEEK_END);
+    if ((end < static_cast<long>(HEADER_SIZE)) ||
+        (_lseek(fd, 0, SEEK_SET) != 0) ||
+        (_read(fd, header, HEADER_SIZE) != static_cast<int>(HEADER_SIZE)))
+      {
+        return false;
+      }
+    size = static_cast<size_t>(end);
+#else
+    struct stat st;
+    if ((fstat(fd, &st) != 0) ||
+        (st.st_size < static_cast<off_t>(HEADER_SIZE)) ||
+        (pread(fd, header, HEADER_SIZE, 0) !=
+         static_cast<ssize_t>(HEADER_SIZE)))
+      {
+        return false;
+      }
+    size = static_cast<size_t>(st.st_size);
+#endif
+    uint64_t stored_checksum;
+    memcpy(&stored_checksum, header + 16, sizeof(stored_checksum));
+    return (memcmp(header, STORE_MAGIC, sizeof(STORE_MAGIC)) == 0) &&
+        (read_u32(header + 8) == STORE_VERSION) &&
+        (stored_checksum == checksum);
+  }
+
+uint64_t
+file_checksum(const string& filename, uint64_t seed)
+  {
+    MappedFile file(filename);
+    return fnv1a(file.get_data(), file.size(), seed);
+  }
+
+SuggestionStore::SuggestionStore(const string& path, uint64_t checksum) :
+    path_(path),
+    checksum_(checksum),
+    mapped_(0),
+    file_(0)
+  {
+    // The header is checked through the descriptor that records are then
+    // read and appended through, so that a store another process moves in
+    // place meanwhile never gets records meant for this one
+    for (int attempt = 0; attempt < OPEN_ATTEMPTS; ++attempt)
+      {
+        int fd = open(path_.c_str(), O_RDWR | O_CREAT | O_APPEND | O_BINARY,
+                      0666);
+        if (fd < 0)
+          {
+            HFSTOSPELL_THROW_MESSAGE(SuggestionStoreException,
+                                     "Could not open " + path_);
+          }
+        size_t size = 0;
+        if (!has_header(fd, checksum_, size))
+          {
+            // missing, empty or for other automata
+            close(fd);
+            start_over();
+            continue;
+          }
+        try
+          {
+            mapped_ = new MappedFile(fd, size);
+          }
+        catch (FileMappingException&)
+          {
+            close(fd);
+            throw;
+          }
+        file_ = fdopen(fd, "ab");
+        if (file_ == 0)
+          {
+            close(fd);
+            delete mapped_;
+            mapped_ = 0;
+            HFSTOSPELL_THROW_MESSAGE(SuggestionStoreException,
+                                     "Could not open " + path_);
+          }
+        // unbuffered, so each record goes out in one write
+        setvbuf(file_, 0, _IONBF, 0);
+        scan();
+        return;
+      }
+    HFSTOSPELL_THROW_MESSAGE(SuggestionStoreException,
+                             "Other stores keep replacing " + path_);
+  }
+
+SuggestionStore::~SuggestionStore()
+  {
+    if (file_ != 0)
+      {
+        fclose(file_);
+      }
+    delete mapped_;
+  }
+
+void
+SuggestionStore::start_over()
+  {
+    // write the new file aside and move it in place, so that processes
+    // still reading the old one through a mapping aren't disturbed, under
+    // a name of its own so that ones starting over at the same time don't
+    // write into it
+    string fresh = temporary_name(path_);
+    FILE* f = fopen(fresh.c_str(), "wb");
+    if (f == 0)
+      {
+        HFSTOSPELL_THROW_MESSAGE(SuggestionStoreException,
+                                 "Could not create " + fresh);
+      }
+    char header[HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    memcpy(header, STORE_MAGIC, sizeof(STORE_MAGIC));
+    memcpy(header + 8, &STORE_VERSION, sizeof(STORE_VERSION));
+    memcpy(header + 16, &checksum_, sizeof(checksum_));
+    bool written = (fwrite(header, 1, sizeof(header), f) == sizeof(header));
+    written = (fclose(f) == 0) && written;
+    if (written && std::rename(fresh.c_str(), path_.c_str()) != 0)
+      {
+#ifdef _WIN32
+        // Windows won't rename over an existing file
+        std::remove(path_.c_str());
+        written = (std::rename(fresh.c_str(), path_.c_str()) == 0);
+#else
+        written = false;
+#endif
+      }
+    if (!written)
+      {
+        std::remove(fresh.c_str());
+        HFSTOSPELL_THROW_MESSAGE(SuggestionStoreException,
+                                 "Could not write " + path_);
+      }
+  }
+
+void
+SuggestionStore::scan()
+  {
+    const char* data = mapped_->get_data();
+    size_t size = mapped_->size();
+    size_t pos = HEADER_SIZE;
+    while (pos + RECORD_HEADER_SIZE <= size)
+      {
+        const char* record = data + pos;
+        size_t left = size - pos - RECORD_HEADER_SIZE;
+        size_t key_length = read_u32(record + 4);
+        size_t value_length = read_u32(record + 8);
+        if ((read_u32(record) != RECORD_MARKER) || (key_length > left) ||
+            (value_length > left - key_length))
+          {
+            ++pos;
+            continue;
+          }
+        const char* key = record + RECORD_HEADER_SIZE;
+        if (read_u32(record + 12) !=
+            record_check(key, key_length, key + key_length, value_length))
+          {
+            ++pos;
+            continue;
+          }
+        // racing writers may both have stored a key; the first one counts
+        string key_string(key, key_length);
+        if (find_mapped(key_string) == 0)
+          {
+            mapped_index_.insert(std::make_pair(fnv1a(key, key_length),
+                                                pos));
+          }
+        pos += RECORD_HEADER_SIZE + key_length + value_length;
+      }
+  }
+
+size_t
+SuggestionStore::find_mapped(const string& key) const
+  {
+    if (mapped_index_.empty())
+      {
+        return 0;
+      }
+    const char* data = mapped_->get_data();
+    auto range = mapped_index_.equal_range(fnv1a(key.data(), key.size()));
+    for (auto it = range.first; it != range.second; ++it)
+      {
+        const char* record = data + it->second;
+        if ((read_u32(record + 4) == key.size()) &&
+            (memcmp(record + RECORD_HEADER_SIZE, key.data(),
+                    key.size()) == 0))
+          {
+            return it->second;
+          }
+      }
+    return 0;
+  }
+
+bool
+SuggestionStore::find(const string& key, CorrectionQueue& corrections)
+  {
+    size_t offset = find_mapped(key);
+    if (offset != 0)
+      {
+        const char* record = mapped_->get_data() + offset;
+        decode_corrections(record + RECORD_HEADER_SIZE + key.size(),
+                           read_u32(record + 8), corrections);
+        return true;
+      }
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = appended_.find(key);
+    if (found == appended_.end())
+      {
+        return false;
+      }
+    decode_corrections(found->second.data(), found->second.size(),
+                       corrections);
+    return true;
+  }
+
+void
+SuggestionStore::insert(const string& key,
+                        const CorrectionQueue& corrections)
+  {
+    if (find_mapped(key) != 0)
+      {
+        return;
+      }
+    string value = encode_corrections(corrections);
+    string record;
+    record.reserve(RECORD_HEADER_SIZE + key.size() + value.size());
+    append_u32(record, RECORD_MARKER);
+    append_u32(record, static_cast<uint32_t>(key.size()));
+    append_u32(record, static_cast<uint32_t>(value.size()));
+    append_u32(record, record_check(key.data(), key.size(),
+                                    value.data(), value.size()));
+    record.append(key);
+    record.append(value);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!appended_.insert(std::make_pair(key, value)).second)
+      {
+        return;
+      }
+    // a store that can't be written to still serves this process; the
+    // corrections are only missing from the file
+    if (fwrite(record.data(), 1, record.size(), file_) != record.size())
+      {
+        clearerr(file_);
+      }
+  }
+
+size_t
+SuggestionStore::size() const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return mapped_index_.size() + appended_.size();
+  }
+
+  } // namespace hfst_ospell
@@ -0,0 +1,100 @@
+/* -*- Mode: C++ -*- */
+// Copyright 2010 University of Helsinki
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#ifndef HFST_OSPELL_SUGGESTIONSTORE_H_
+#define HFST_OSPELL_SUGGESTIONSTORE_H_
+
+#include "hfstol-stdafx.h"
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <stdint.h>
+
+#include "ospell.h"
+#include "hfst-ol.h"
+
+namespace hfst_ospell
+  {
+    //! @brief checksum of the contents of @a filename, continuing from
+    //!        @a seed so that several files can be summed up in turn.
+    OSPELL_API uint64_t file_checksum(const std::string& filename,
+                                      uint64_t seed = 14695981039346656037ull);
+
+    //! @brief SuggestionStore keeps corrections by the same keys as the
+    //!        suggestion cache in a file that outlives the process.
+    //!
+    //! The file starts with the checksum of the automata the corrections
+    //! came from and is only ever appended to, one record per key, by any
+    //! number of processes. The records found when the store is opened
+    //! are read from a memory mapping of the file; those appended later
+    //! by this process are kept in memory too, and those appended by
+    //! other processes are seen the next time the store is opened. A file
+    //! made for other automata, or for none, is replaced with an empty one
+    //! when opened, without disturbing processes still using the old one.
+    class SuggestionStore
+      {
+        public:
+            //! @brief open the store at @a path for automata with
+            //!        @a checksum, creating or replacing it as needed.
+            OSPELL_API SuggestionStore(const std::string& path,
+                                       uint64_t checksum);
+            OSPELL_API ~SuggestionStore();
+            //! @brief copy the corrections stored for @a key into
+            //!        @a corrections if there are any.
+            OSPELL_API bool find(const std::string& key,
+                                 CorrectionQueue& corrections);
+            //! @brief append @a corrections for @a key to the file,
+            //!        unless some are stored for it already.
+            OSPELL_API void insert(const std::string& key,
+                                   const CorrectionQueue& corrections);
+            //! @brief number of keys with corrections stored
+            OSPELL_API size_t size() const;
+        private:
+            SuggestionStore(const SuggestionStore&);
+            SuggestionStore& operator=(const SuggestionStore&);
+            //! @brief replace the file with one holding just the header
+            void start_over();
+            //! @brief index the records of the mapping
+            void scan();
+            //! @brief offset of the record of @a key in the mapping, or 0
+            size_t find_mapped(const std::string& key) const;
+
+            //! @brief where the store is
+            std::string path_;
+            //! @brief checksum of the automata of the corrections
+            uint64_t checksum_;
+            //! @brief the file as it was when opened, or 0 if it was empty
+            MappedFile* mapped_;
+            //! @brief record offsets in the mapping by key hash
+            std::unordered_multimap<uint64_t, size_t> mapped_index_;
+            //! @brief encoded corrections appended since opening, by key
+            std::unordered_map<std::string, std::string> appended_;
+            //! @brief the file opened for appending
+            FILE* file_;
+            //! @brief guards appended_ and file_
+            mutable std::mutex mutex_;
+      };
+
+  } // namespace hfst_ospell
+
+#endif // HFST_OSPELL_SUGGESTIONSTORE_H_
+// vim: set ft=cpp.doxygen:
@@ -26,9 +26,20 @@
 #if HAVE_LIBXML
 #  include <libxml++/libxml++.h>
 #endif
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
 #include <string>
 #include <map>
 
+#ifdef _WIN32
+#  include <process.h>
+#  define getpid _getpid
+#else
+#  include <unistd.h>
+#endif
+
 using std::string;
 using std::map;
 
@@ -36,107 +47,137 @@ using std::map;
 #include "ospell.h"
 #include "hfst-ol.h"
 #include "ZHfstOspeller.h"
-
-#ifdef WIN32
-#include <io.h>
-#include <fcntl.h>
-#include <windows.h>
-#endif
+#include "BatchSpeller.h"
 
 namespace hfst_ospell
   {
 
+// An ospell image is a header followed by the default acceptor and, if
+// the flags have IMAGE_HAS_ERRMODEL, the default error model and what
+// the speller builds from them, as Transducer::write() and
+// Speller::write_image() put them:
+//
+//   header: magic[8], version (u32), byte order mark (u32), flags (u32)
+//
+// all in native byte order, with the table columns aligned from the start
+// of the file so that they're searched in place in a mapping of it.
+static const char IMAGE_MAGIC[8] = { 'O', 'S', 'P', 'E', 'L', 'L', 'I', 'M' };
+static const uint32_t IMAGE_VERSION = 2;
+static const uint32_t IMAGE_BYTE_ORDER = 0x01020304u;
+static const uint32_t IMAGE_HAS_ERRMODEL = 1;
+
 #if HAVE_LIBARCHIVE
-inline std::string extract_to_mem(archive* ar, archive_entry* entry) {
+// Read the data of the current entry of @a ar into a buffer of the size
+// its header gives, as the decompressor hands it out.
+static std::string
+extract_to_mem(archive* ar, archive_entry* entry)
+  {
+    std::string buff;
+    if (archive_entry_size_is_set(entry))
+      {
+        buff.resize(archive_entry_size(entry));
+      }
     size_t full_length = 0;
-    const struct stat* st = archive_entry_stat(entry);
-    size_t buffsize = st->st_size;
-    if (buffsize == 0) {
-        std::cerr << archive_error_string(ar) << std::endl;
-        throw ZHfstZipReadingError("Reading archive resulted in zero length entry");
-    }
-
-    std::string buff(buffsize, 0);
-    for (;;) {
-        ssize_t curr = archive_read_data(ar, &buff[0] + full_length, buffsize - full_length);
-        if (0 == curr) {
+    for (;;)
+      {
+        const void* block = 0;
+        size_t block_size = 0;
+#if USE_LIBARCHIVE_2
+        off_t offset = 0;
+#else
+        int64_t offset = 0;
+#endif // USE_LIBARCHIVE_2
+        int rr = archive_read_data_block(ar, &block, &block_size, &offset);
+        if (rr == ARCHIVE_EOF)
+          {
             break;
-        }
-        else if (ARCHIVE_RETRY == curr) {
+          }
+        else if (rr == ARCHIVE_RETRY)
+          {
             continue;
-        }
-        else if (ARCHIVE_FAILED == curr) {
-            throw ZHfstZipReadingError("Archive broken (ARCHIVE_FAILED)");
-        }
-        else if (curr < 0) {
-            throw ZHfstZipReadingError("Archive broken...");
-        }
-        else {
-            full_length += curr;
-        }
-    }
-
-    if (full_length == 0) {
-        std::cerr << archive_error_string(ar) << std::endl;
+          }
+        else if ((rr < ARCHIVE_WARN) || (offset < 0))
+          {
+            throw ZHfstZipReadingError("Archive broken");
+          }
+        size_t block_end = static_cast<size_t>(offset) + block_size;
+        if (block_end > buff.size())
+          {
+            // the header didn't tell, or told too little
+            buff.resize(block_end);
+          }
+        memcpy(&buff[0] + offset, block, block_size);
+        full_length = std::max(full_length, block_end);
+      }
+    buff.resize(full_length);
+    if (full_length == 0)
+      {
         throw ZHfstZipReadingError("Reading archive resulted in zero length");
-    }
-
+      }
     return buff;
-}
+  }
 
-inline Transducer* transducer_to_mem(archive* ar, archive_entry* entry) {
+// Read the transducer of the current entry of @a ar.
+static Transducer*
+read_transducer(archive* ar, archive_entry* entry)
+  {
     std::string buff = extract_to_mem(ar, entry);
-    Transducer *trans = new Transducer(&buff[0]);
-    return trans;
-}
-
-inline char* extract_to_tmp_dir(archive* ar) {
-#ifdef WIN32
-    char rv[MAX_PATH+1];
-    if (!GetTempPathA(MAX_PATH, rv)) {
-        throw ZHfstZipReadingError("Could not get temporary path");
-    }
-    strcat(rv, "zhfstospellXXXXXX");
-    mktemp(rv);
-    int temp_fd = open(rv, _O_CREAT | _O_TRUNC | _O_RDWR);
-#else
-    char rv[] = "/tmp/zhfstospellXXXXXXXX";
-    int temp_fd = mkstemp(rv);
-#endif
-    int rr = archive_read_data_into_fd(ar, temp_fd);
-    if ((rr != ARCHIVE_EOF) && (rr != ARCHIVE_OK)) {
-        throw ZHfstZipReadingError("Archive not EOF'd or OK'd");
-    }
-    close(temp_fd);
-    return strdup(rv);
-}
-
-inline Transducer* transducer_to_tmp_dir(archive* ar) {
-    char *filename = extract_to_tmp_dir(ar);
-    FILE* f = fopen(filename, "rb");
-    free(filename);
-    if (f == nullptr) {
-        throw ZHfstTemporaryWritingError("reading acceptor back from temp file");
-    }
-    return new Transducer(f);
-}
+    return new Transducer(&buff[0], buff.size());
+  }
 
 #endif // HAVE_LIBARCHIVE
 
+SuggestionStream::SuggestionStream(Speller* speller,
+                                   SearchContext* context) :
+    speller_(speller),
+    context_(context)
+    {
+    }
+
+SuggestionStream::~SuggestionStream()
+  {
+    if (context_ != 0)
+      {
+        speller_->release_context(context_);
+      }
+  }
+
+bool
+SuggestionStream::next(StringWeightPair& correction)
+  {
+    if (context_ == 0)
+      {
+        return false;
+      }
+    return context_->next_correction(correction);
+  }
+
 ZHfstOspeller::ZHfstOspeller() :
     suggestions_maximum_(0),
     maximum_weight_(-1.0),
     beam_(-1.0),
     time_cutoff_(0.0),
+    best_first_(false),
+    parallel_threads_(1),
+    parallel_min_length_(0),
     can_spell_(false),
     can_correct_(false),
     can_analyse_(true),
     current_speller_(0),
-    current_sugger_(0)
+    current_sugger_(0),
+    image_(0),
+    stop_cache_builder_(false)
     {
     }
 
 ZHfstOspeller::~ZHfstOspeller()
+  {
+    stop_prebuilding();
+    clear_automata();
+  }
+
+void
+ZHfstOspeller::clear_automata()
   {
     if ((current_speller_ != NULL) && (current_sugger_ != NULL))
       {
@@ -160,6 +201,11 @@ ZHfstOspeller::~ZHfstOspeller()
       {
         delete errmodel.second;
       }
+    acceptors_.clear();
+    errmodels_.clear();
+    // the automata borrowed their tables from it
+    delete image_;
+    image_ = 0;
     can_spell_ = false;
     can_correct_ = false;
   }
@@ -167,10 +213,29 @@ ZHfstOspeller::~ZHfstOspeller()
 void
 ZHfstOspeller::inject_speller(Speller * s)
   {
+      stop_prebuilding();
       current_speller_ = s;
       current_sugger_ = s;
       can_spell_ = true;
       can_correct_ = true;
+      filename_.clear();
+      suggestion_cache_.clear();
+      analysis_cache_.clear();
+      close_suggestion_store();
+  }
+
+ZHfstOspeller::SearchSettings
+ZHfstOspeller::search_settings() const
+  {
+    SearchSettings settings;
+    settings.suggestions_maximum = suggestions_maximum_;
+    settings.maximum_weight = maximum_weight_;
+    settings.beam = beam_;
+    settings.time_cutoff = time_cutoff_;
+    settings.best_first = best_first_;
+    settings.parallel_threads = parallel_threads_;
+    settings.parallel_min_length = parallel_min_length_;
+    return settings;
   }
 
 void
@@ -197,6 +262,270 @@ ZHfstOspeller::set_time_cutoff(float time_cutoff)
       time_cutoff_ = time_cutoff;
   }
 
+void
+ZHfstOspeller::set_best_first(bool best_first)
+  {
+      best_first_ = best_first;
+  }
+
+void
+ZHfstOspeller::set_parallel_correction(unsigned int threads,
+                                       unsigned int min_length)
+  {
+      parallel_threads_ = (threads == 0) ? 1 : threads;
+      parallel_min_length_ = min_length;
+  }
+
+void
+ZHfstOspeller::prebuild_cache(bool in_background)
+  {
+    if (!can_correct_ || (current_sugger_ == 0))
+      {
+        return;
+      }
+    if (in_background)
+      {
+        std::lock_guard<std::mutex> lock(cache_builder_mutex_);
+        join_cache_builder();
+        cache_builder_ = std::thread(&Speller::build_all_caches,
+                                     current_sugger_, &stop_cache_builder_);
+      }
+    else
+      {
+        stop_prebuilding();
+        current_sugger_->build_all_caches();
+      }
+  }
+
+void
+ZHfstOspeller::stop_prebuilding()
+  {
+    std::lock_guard<std::mutex> lock(cache_builder_mutex_);
+    join_cache_builder();
+  }
+
+void
+ZHfstOspeller::join_cache_builder()
+  {
+    if (cache_builder_.joinable())
+      {
+        stop_cache_builder_ = true;
+        cache_builder_.join();
+        stop_cache_builder_ = false;
+      }
+  }
+
+// Write @a blob to the file at @a path aside and move it in place, so
+// readers never see half a file. The file aside has a name of its own, so
+// that processes saving to the same path at once don't write into it.
+static void
+write_aside(const string& path, const string& blob)
+  {
+    static std::atomic<unsigned long> counter(0);
+    string fresh = path + ".new." +
+        std::to_string(static_cast<long>(getpid())) + "." +
+        std::to_string(counter++);
+    FILE* f = fopen(fresh.c_str(), "wb");
+    if (f == 0)
+      {
+        throw ZHfstTemporaryWritingError("Could not create " + fresh);
+      }
+    bool written = (fwrite(blob.data(), 1, blob.size(), f) == blob.size());
+    written = (fclose(f) == 0) && written;
+    if (written && std::rename(fresh.c_str(), path.c_str()) != 0)
+      {
+#ifdef _WIN32
+        // Windows won't rename over an existing file
+        std::remove(path.c_str());
+        written = (std::rename(fresh.c_str(), path.c_str()) == 0);
+#else
+        written = false;
+#endif
+      }
+    if (!written)
+      {
+        std::remove(fresh.c_str());
+        throw ZHfstTemporaryWritingError("Could not write " + path);
+      }
+  }
+
+void
+ZHfstOspeller::save_cache(const string& path)
+  {
+    save_cache(path, archive_checksum());
+  }
+
+void
+ZHfstOspeller::save_cache(const string& path, uint64_t checksum)
+  {
+    if (!can_correct_ || (current_sugger_ == 0))
+      {
+        return;
+      }
+    string blob(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+    current_sugger_->write_cache(blob);
+    write_aside(path, blob);
+  }
+
+bool
+ZHfstOspeller::load_cache(const string& path)
+  {
+    return load_cache(path, archive_checksum());
+  }
+
+bool
+ZHfstOspeller::load_cache(const string& path, uint64_t checksum)
+  {
+    if (!can_correct_ || (current_sugger_ == 0))
+      {
+        return false;
+      }
+    MappedFile* file = 0;
+    try
+      {
+        file = new MappedFile(path);
+      }
+    catch (FileMappingException&)
+      {
+        return false;
+      }
+    uint64_t saved_checksum = 0;
+    bool loaded = false;
+    if (file->size() >= sizeof(saved_checksum))
+      {
+        memcpy(&saved_checksum, file->get_data(), sizeof(saved_checksum));
+        loaded = (saved_checksum == checksum) &&
+            current_sugger_->read_cache(
+                file->get_data() + sizeof(saved_checksum),
+                file->size() - sizeof(saved_checksum));
+      }
+    delete file;
+    return loaded;
+  }
+
+void
+ZHfstOspeller::save_image(const string& path)
+  {
+    Transducer* lexicon = (current_speller_ != 0) ?
+        current_speller_->lexicon : 0;
+    Transducer* mutator = can_correct_ ? current_sugger_->mutator : 0;
+    if (!can_spell_ || (lexicon == 0) ||
+        (can_correct_ && (current_sugger_->lexicon != lexicon)))
+      {
+        throw ZHfstException("No speller to save an image of");
+      }
+    string blob(IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    put_u32(blob, IMAGE_VERSION);
+    put_u32(blob, IMAGE_BYTE_ORDER);
+    put_u32(blob, (mutator != 0) ? IMAGE_HAS_ERRMODEL : 0);
+    lexicon->write(blob);
+    if (mutator != 0)
+      {
+        mutator->write(blob);
+        current_sugger_->write_image(blob);
+      }
+    write_aside(path, blob);
+  }
+
+void
+ZHfstOspeller::read_image(const string& path)
+  {
+    stop_prebuilding();
+    MappedFile* image = new MappedFile(path);
+    Transducer* lexicon = 0;
+    Transducer* mutator = 0;
+    Speller* speller = 0;
+    try
+      {
+        ImageReader reader(image->get_data(), image->size());
+        if (memcmp(reader.read_bytes(sizeof(IMAGE_MAGIC)), IMAGE_MAGIC,
+                   sizeof(IMAGE_MAGIC)) != 0)
+          {
+            HFSTOSPELL_THROW_MESSAGE(ImageReadingException,
+                                     "Not an ospell image: " + path);
+          }
+        if (reader.read_u32() != IMAGE_VERSION)
+          {
+            HFSTOSPELL_THROW_MESSAGE(ImageReadingException,
+                                     "Unknown ospell image version");
+          }
+        if (reader.read_u32() != IMAGE_BYTE_ORDER)
+          {
+            HFSTOSPELL_THROW_MESSAGE(ImageReadingException,
+                                     "Ospell image of other byte order");
+          }
+        uint32_t flags = reader.read_u32();
+        lexicon = new Transducer(reader);
+        if ((flags & IMAGE_HAS_ERRMODEL) != 0)
+          {
+            mutator = new Transducer(reader);
+            speller = new Speller(mutator, lexicon, reader);
+          }
+        else
+          {
+            speller = new Speller(0, lexicon);
+          }
+      }
+    catch (...)
+      {
+        delete speller;
+        delete mutator;
+        delete lexicon;
+        delete image;
+        throw;
+      }
+    clear_automata();
+    image_ = image;
+    acceptors_["default"] = lexicon;
+    if (mutator != 0)
+      {
+        errmodels_["default"] = mutator;
+      }
+    current_speller_ = speller;
+    current_sugger_ = speller;
+    can_spell_ = true;
+    can_correct_ = (mutator != 0);
+    can_analyse_ = true;
+    filename_ = path;
+    suggestion_cache_.clear();
+    analysis_cache_.clear();
+    close_suggestion_store();
+  }
+
+bool
+ZHfstOspeller::is_image(const string& path)
+  {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (f == 0)
+      {
+        return false;
+      }
+    char magic[sizeof(IMAGE_MAGIC)];
+    bool rv = (fread(magic, 1, sizeof(magic), f) == sizeof(magic)) &&
+        (memcmp(magic, IMAGE_MAGIC, sizeof(magic)) == 0);
+    fclose(f);
+    return rv;
+  }
+
+void
+ZHfstOspeller::set_prefix_cache(unsigned int depth, size_t bytes)
+  {
+    if (can_correct_ && (current_sugger_ != 0))
+      {
+        current_sugger_->set_prefix_cache(depth, bytes);
+      }
+  }
+
+size_t
+ZHfstOspeller::set_known_forms(const std::vector<string>& wordforms)
+  {
+    if (can_spell_ && (current_speller_ != 0))
+      {
+        return current_speller_->set_known_forms(wordforms);
+      }
+    return 0;
+  }
+
 bool
 ZHfstOspeller::spell(const string& wordform)
   {
@@ -214,24 +543,248 @@ CorrectionQueue
 ZHfstOspeller::suggest(const string& wordform)
   {
     CorrectionQueue rv;
+    if ((can_correct_) && (current_sugger_ != 0))
+      {
+        std::vector<char> wf;
+        bool truncated;
+        SearchSettings settings = search_settings();
+        SearchContext* context = current_sugger_->acquire_context();
+        context->parallel_threads = settings.parallel_threads;
+        context->parallel_min_length = settings.parallel_min_length;
+        rv = correct_in(context, settings, wordform, wf,
+                        deadline_in(settings.time_cutoff), truncated);
+        current_sugger_->release_context(context);
+        return rv;
+      }
+    return rv;
+  }
+
+CorrectionQueue
+ZHfstOspeller::suggest(const string& wordform, Deadline deadline,
+                       bool& truncated)
+  {
+    CorrectionQueue rv;
+    truncated = false;
+    if ((can_correct_) && (current_sugger_ != 0))
+      {
+        std::vector<char> wf;
+        SearchSettings settings = search_settings();
+        SearchContext* context = current_sugger_->acquire_context();
+        context->parallel_threads = settings.parallel_threads;
+        context->parallel_min_length = settings.parallel_min_length;
+        rv = correct_in(context, settings, wordform, wf, deadline,
+                        truncated);
+        current_sugger_->release_context(context);
+      }
+    return rv;
+  }
+
+SuggestionStream*
+ZHfstOspeller::suggest_stream(const string& wordform)
+  {
     if ((can_correct_) && (current_sugger_ != 0))
       {
         char* wf = strdup(wordform.c_str());
-        rv = current_sugger_->correct(wf,
-                                      suggestions_maximum_,
-                                      maximum_weight_,
-                                      beam_,
-                                      time_cutoff_);
+        SearchSettings settings = search_settings();
+        SearchContext* context = current_sugger_->acquire_context();
+        context->start_correcting(wf,
+                                  settings.suggestions_maximum,
+                                  settings.maximum_weight,
+                                  settings.beam,
+                                  deadline_in(settings.time_cutoff));
         free(wf);
-        return rv;
+        return new SuggestionStream(current_sugger_, context);
+      }
+    return new SuggestionStream(0, 0);
+  }
+
+std::vector<bool>
+ZHfstOspeller::spell_batch(const std::vector<string>& wordforms)
+  {
+    std::vector<bool> rv(wordforms.size(), false);
+    if (can_spell_ && (current_speller_ != 0))
+      {
+        // one search context and buffer for the whole batch
+        SearchContext* context = current_speller_->acquire_context();
+        std::vector<char> wf;
+        for (size_t i = 0; i < wordforms.size(); ++i)
+          {
+            wf.assign(wordforms[i].begin(), wordforms[i].end());
+            wf.push_back('\0');
+            rv[i] = context->check(&wf[0]);
+          }
+        current_speller_->release_context(context);
+      }
+    return rv;
+  }
+
+std::vector<CorrectionQueue>
+ZHfstOspeller::suggest_batch(const std::vector<string>& wordforms)
+  {
+    std::vector<CorrectionQueue> rv(wordforms.size());
+    if ((can_correct_) && (current_sugger_ != 0))
+      {
+        // one search context, buffer and set of settings for the
+        // whole batch
+        SearchSettings settings = search_settings();
+        SearchContext* context = current_sugger_->acquire_context();
+        context->parallel_threads = settings.parallel_threads;
+        context->parallel_min_length = settings.parallel_min_length;
+        std::vector<char> wf;
+        bool truncated;
+        for (size_t i = 0; i < wordforms.size(); ++i)
+          {
+            rv[i] = correct_in(context, settings, wordforms[i], wf,
+                               deadline_in(settings.time_cutoff), truncated);
+          }
+        current_sugger_->release_context(context);
+      }
+    return rv;
+  }
+
+CorrectionQueue
+ZHfstOspeller::correct_in(SearchContext* context,
+                          const SearchSettings& settings,
+                          const string& wordform,
+                          std::vector<char>& buffer, Deadline deadline,
+                          bool& truncated)
+  {
+    CorrectionQueue rv;
+    truncated = false;
+    // the store as it is now, for the whole call
+    std::shared_ptr<SuggestionStore> store =
+        std::atomic_load(&suggestion_store_);
+    string key;
+    if (suggestion_cache_.enabled() || store)
+      {
+        // the word form and everything else the corrections depend on
+        key = wordform;
+        key.push_back('\0');
+        key.append(
+            reinterpret_cast<const char*>(&settings.suggestions_maximum),
+            sizeof(settings.suggestions_maximum));
+        key.append(reinterpret_cast<const char*>(&settings.maximum_weight),
+                   sizeof(settings.maximum_weight));
+        key.append(reinterpret_cast<const char*>(&settings.beam),
+                   sizeof(settings.beam));
+        key.push_back(settings.best_first ? 'b' : 'd');
+        if (suggestion_cache_.find(key, rv))
+          {
+            return rv;
+          }
+        if (store && store->find(key, rv))
+          {
+            suggestion_cache_.insert(key, rv);
+            return rv;
+          }
+      }
+    buffer.assign(wordform.begin(), wordform.end());
+    buffer.push_back('\0');
+    context->search_order = settings.best_first ?
+        SearchContext::BestFirst : SearchContext::DepthFirst;
+    rv = context->correct_until(&buffer[0], deadline,
+                                settings.suggestions_maximum,
+                                settings.maximum_weight,
+                                settings.beam);
+    truncated = context->limit_reached;
+    if (!key.empty() && !truncated)
+      {
+        suggestion_cache_.insert(key, rv);
+        if (store)
+          {
+            store->insert(key, rv);
+          }
       }
     return rv;
   }
 
+uint64_t
+ZHfstOspeller::archive_checksum() const
+  {
+    if (filename_.empty())
+      {
+        throw ZHfstException("No archive read to tie the file to");
+      }
+    return file_checksum(filename_);
+  }
+
+void
+ZHfstOspeller::open_suggestion_store(const string& path)
+  {
+    open_suggestion_store(path, archive_checksum());
+  }
+
+void
+ZHfstOspeller::open_suggestion_store(const string& path, uint64_t checksum)
+  {
+    std::atomic_store(&suggestion_store_,
+                      std::make_shared<SuggestionStore>(path, checksum));
+  }
+
+void
+ZHfstOspeller::close_suggestion_store()
+  {
+    std::atomic_store(&suggestion_store_, std::shared_ptr<SuggestionStore>());
+  }
+
+size_t
+ZHfstOspeller::populate_suggestion_store(const std::vector<string>& wordforms)
+  {
+    std::shared_ptr<SuggestionStore> store =
+        std::atomic_load(&suggestion_store_);
+    if (!store)
+      {
+        return 0;
+      }
+    std::vector<string> misspelled;
+    std::vector<bool> spelled = spell_batch(wordforms);
+    for (size_t i = 0; i < wordforms.size(); ++i)
+      {
+        if (!spelled[i])
+          {
+            misspelled.push_back(wordforms[i]);
+          }
+      }
+    // corrections go into the store on the way out of the search
+    BatchSpeller batch(*this);
+    batch.suggest(misspelled);
+    return store->size();
+  }
+
+void
+ZHfstOspeller::set_cache_size(size_t suggestions, size_t analyses)
+  {
+    suggestion_cache_.set_capacity(suggestions);
+    analysis_cache_.set_capacity(analyses);
+  }
+
+CacheCounters
+ZHfstOspeller::get_suggestion_cache_counters() const
+  {
+    return suggestion_cache_.get_counters();
+  }
+
+CacheCounters
+ZHfstOspeller::get_analysis_cache_counters() const
+  {
+    return analysis_cache_.get_counters();
+  }
+
 AnalysisQueue
 ZHfstOspeller::analyse(const string& wordform, bool ask_sugger)
   {
     AnalysisQueue rv;
+    string key;
+    if (analysis_cache_.enabled())
+      {
+        key = wordform;
+        key.push_back('\0');
+        key.push_back(ask_sugger ? 's' : 'a');
+        if (analysis_cache_.find(key, rv))
+          {
+            return rv;
+          }
+      }
     char* wf = strdup(wordform.c_str());
     if ((can_analyse_) && (!ask_sugger) && (current_speller_ != 0))
       {
@@ -242,6 +795,10 @@ ZHfstOspeller::analyse(const string& wordform, bool ask_sugger)
           rv = current_sugger_->analyse(wf);
       }
     free(wf);
+    if (!key.empty())
+      {
+        analysis_cache_.insert(key, rv);
+      }
     return rv;
   }
 
@@ -287,6 +844,7 @@ void
 ZHfstOspeller::read_zhfst(const string& filename)
   {
 #if HAVE_LIBARCHIVE
+    stop_prebuilding();
     struct archive* ar = archive_read_new();
     struct archive_entry* entry = 0;
 
@@ -310,36 +868,11 @@ ZHfstOspeller::read_zhfst(const string& filename)
           {
             throw ZHfstZipReadingError("Archive not OK");
           }
-        char* filename = strdup(archive_entry_pathname(entry));
-        if (strncmp(filename, "acceptor.", strlen("acceptor.")) == 0) {
-            Transducer* trans = nullptr;
-
-#if ZHFST_EXTRACT_TO_MEM == 1
-            // Try to memory first...
-            try {
-                trans = transducer_to_mem(ar, entry);
-            }
-            catch (...) {
-                // If that failed, try to /tmp
-                //std::cerr << "Failed to memory - falling back to /tmp" << std::endl;
-                trans = transducer_to_tmp_dir(ar);
-            }
-#else
-            // Try to /tmp first...
-            try {
-                trans = transducer_to_tmp_dir(ar);
-            }
-            catch (...) {
-                // If that failed, try to memory
-                //std::cerr << "Failed to /tmp - falling back to memory" << std::endl;
-                trans = transducer_to_mem(ar, entry);
-            }
-#endif
-            if (trans == nullptr) {
-                throw ZHfstZipReadingError("Failed to extract acceptor");
-            }
+        char* member = strdup(archive_entry_pathname(entry));
+        if (strncmp(member, "acceptor.", strlen("acceptor.")) == 0) {
+            Transducer* trans = read_transducer(ar, entry);
 
-            char* p = filename;
+            char* p = member;
             p += strlen("acceptor.");
             size_t descr_len = 0;
             for (const char* q = p; *q != '\0'; q++)
@@ -358,35 +891,10 @@ ZHfstOspeller::read_zhfst(const string& filename)
             acceptors_[descr] = trans;
             free(descr);
           }
-        else if (strncmp(filename, "errmodel.", strlen("errmodel.")) == 0) {
-            Transducer* trans = nullptr;
-
-#if ZHFST_EXTRACT_TO_MEM == 1
-            // Try to memory first...
-            try {
-                trans = transducer_to_mem(ar, entry);
-            }
-            catch (...) {
-                // If that failed, try to /tmp
-                //std::cerr << "Failed to memory - falling back to /tmp" << std::endl;
-                trans = transducer_to_tmp_dir(ar);
-            }
-#else
-            // Try to /tmp first...
-            try {
-                trans = transducer_to_tmp_dir(ar);
-            }
-            catch (...) {
-                // If that failed, try to memory
-                //std::cerr << "Failed to /tmp - falling back to memory" << std::endl;
-                trans = transducer_to_mem(ar, entry);
-            }
-#endif
-            if (trans == nullptr) {
-                throw ZHfstZipReadingError("Failed to extract error model");
-            }
+        else if (strncmp(member, "errmodel.", strlen("errmodel.")) == 0) {
+            Transducer* trans = read_transducer(ar, entry);
 
-            const char* p = filename;
+            const char* p = member;
             p += strlen("errmodel.");
             size_t descr_len = 0;
             for (const char* q = p; *q != '\0'; q++)
@@ -405,23 +913,15 @@ ZHfstOspeller::read_zhfst(const string& filename)
             errmodels_[descr] = trans;
             free(descr);
           } // if acceptor or errmodel
-        else if (strcmp(filename, "index.xml") == 0) {
-            // Always try to memory first, as index.xml is tiny
-            try {
-                std::string full_data = extract_to_mem(ar, entry);
-                metadata_.read_xml(&full_data[0], full_data.size());
-            }
-            catch (...) {
-                char* temporary = extract_to_tmp_dir(ar);
-                metadata_.read_xml(temporary);
-                free(temporary);
-            }
+        else if (strcmp(member, "index.xml") == 0) {
+            std::string full_data = extract_to_mem(ar, entry);
+            metadata_.read_xml(&full_data[0], full_data.size());
           }
         else
           {
-            fprintf(stderr, "Unknown file in archive %s\n", filename);
+            fprintf(stderr, "Unknown file in archive %s\n", member);
           }
-        free(filename);
+        free(member);
       } // while r != ARCHIVE_EOF
     archive_read_close(ar);
 
@@ -475,6 +975,10 @@ ZHfstOspeller::read_zhfst(const string& filename)
         throw ZHfstZipReadingError("No automata found in zip");
       }
     can_analyse_ = can_spell_ | can_correct_;
+    filename_ = filename;
+    suggestion_cache_.clear();
+    analysis_cache_.clear();
+    close_suggestion_store();
 #else
     throw ZHfstZipReadingError("Zip support was disabled");
 #endif // HAVE_LIBARCHIVE
@@ -34,15 +34,52 @@
 #  include <config.h>
 #endif
 
+#include <atomic>
+#include <memory>
 #include <stdexcept>
 #include <map>
+#include <mutex>
+#include <thread>
 
 #include "ospell.h"
 #include "hfst-ol.h"
 #include "ZHfstOspellerXmlMetadata.h"
+#include "ResultCache.h"
+#include "SuggestionStore.h"
 
 namespace hfst_ospell
   {
+    class BatchSpeller;
+
+    //! @brief SuggestionStream gives the corrections of one word form one
+    //!        at a time, cheapest first.
+    //!
+    //! Each correction is given as soon as the search knows that no
+    //! cheaper one is left, so the first ones come long before the search
+    //! would finish, and a caller can stop taking them at any point.
+    //! The stream searches in a context of its own; it must not outlive
+    //! the ZHfstOspeller it came from.
+    class SuggestionStream
+      {
+        public:
+            //! @brief give the search context back to the speller.
+            OSPELL_API ~SuggestionStream();
+            //! @brief get the next correction into @a correction.
+            //! @return false when there are no more corrections
+            OSPELL_API bool next(StringWeightPair& correction);
+        private:
+            friend class ZHfstOspeller;
+            //! @brief stream corrections from @a context of @a speller,
+            //!        or none if @a context is 0
+            SuggestionStream(Speller* speller, SearchContext* context);
+            SuggestionStream(const SuggestionStream&);
+            SuggestionStream& operator=(const SuggestionStream&);
+            //! @brief speller the search context belongs to
+            Speller* speller_;
+            //! @brief search context searching for the corrections
+            SearchContext* context_;
+      };
+
     //! @brief ZHfstOspeller class holds one speller contained in one
     //!        zhfst file.
     //!        Ospeller can perform all basic writer tool functionality that
@@ -60,6 +97,10 @@ namespace hfst_ospell
             OSPELL_API void inject_speller(Speller * s);
             //! @brief set upper limit to priority queue when performing
             //         suggestions or analyses.
+            //!
+            //! This and the other settings below may change while other
+            //! threads search; each search uses the settings as they were
+            //! when it started.
             OSPELL_API void set_queue_limit(unsigned long limit);
             //! @brief set upper limit for weights
             OSPELL_API void set_weight_limit(Weight limit);
@@ -67,15 +108,136 @@ namespace hfst_ospell
             OSPELL_API void set_beam(Weight beam);
             //! @brief set time cutoff for correcting
             OSPELL_API void set_time_cutoff(float time_cutoff);
+            //! @brief search corrections cheapest first, stopping as soon
+            //!        as the best ones are known, instead of depth first.
+            OSPELL_API void set_best_first(bool best_first);
+            //! @brief split the search for corrections of word forms of at
+            //!        least @a min_length symbols over @a threads threads.
+            //!
+            //! Only applies to depth first search; 1 thread turns it off.
+            OSPELL_API void set_parallel_correction(unsigned int threads,
+                                                    unsigned int min_length);
+            //! @brief build the cache of the search below each first
+            //!        symbol now rather than on first use, so that early
+            //!        corrections are as quick as later ones.
+            //!
+            //! With @a in_background, the building goes on in a thread
+            //! of its own while corrections are searched for; a search
+            //! needing an entry not built yet builds it itself.
+            OSPELL_API void prebuild_cache(bool in_background = true);
+            //! @brief save the cache of the search below each first
+            //!        symbol to the file at @a path, building it all
+            //!        first, for load_cache() to read in later processes.
+            //!
+            //! The file is tied to the checksum of the archive read last.
+            OSPELL_API void save_cache(const std::string& path);
+            //! @brief save the cache as above, tied to @a checksum, e.g.
+            //!        the file_checksum() of the injected automata.
+            OSPELL_API void save_cache(const std::string& path,
+                                       uint64_t checksum);
+            //! @brief read the cache saved by save_cache() at @a path.
+            //! @return false if the file is missing or not for the
+            //!         archive read last
+            OSPELL_API bool load_cache(const std::string& path);
+            //! @brief read the cache as above, if tied to @a checksum.
+            OSPELL_API bool load_cache(const std::string& path,
+                                       uint64_t checksum);
+            //! @brief cache the search for corrections below the first
+            //!        @a depth symbols of word forms, in at most @a bytes
+            //!        besides the first-symbol cache.
+            //!
+            //! Word forms sharing a prefix then skip the search through
+            //! it, where the error model branches out the most. Applies
+            //! to the automata loaded, and other threads may search
+            //! meanwhile; a depth of 1 or a budget of 0 turns it off.
+            OSPELL_API void set_prefix_cache(unsigned int depth,
+                                             size_t bytes);
+            //! @brief keep the results of up to @a suggestions suggest()
+            //!        and @a analyses analyse() calls to give again for
+            //!        the same word form and settings; 0 keeps none.
+            OSPELL_API void set_cache_size(size_t suggestions,
+                                           size_t analyses);
+            //! @brief how often suggest() found its results cached
+            OSPELL_API CacheCounters get_suggestion_cache_counters() const;
+            //! @brief how often analyse() found its results cached
+            OSPELL_API CacheCounters get_analysis_cache_counters() const;
+            //! @brief keep corrections also in the suggestion store file at
+            //!        @a path, where later processes find them.
+            //!
+            //! The store is tied to the checksum of the archive read last,
+            //! so that it starts over when the archive changes. Reading
+            //! or injecting other automata closes it. Other threads may
+            //! suggest meanwhile; searches already running finish with
+            //! the store they started with.
+            OSPELL_API void open_suggestion_store(const std::string& path);
+            //! @brief keep corrections also in the suggestion store file at
+            //!        @a path, for the automata with @a checksum, e.g.
+            //!        the file_checksum() of the injected ones.
+            OSPELL_API void open_suggestion_store(const std::string& path,
+                                                  uint64_t checksum);
+            //! @brief stop keeping corrections in the suggestion store
+            OSPELL_API void close_suggestion_store();
+            //! @brief construct and store the corrections of those of the
+            //!        given word forms that are misspelled, e.g. the most
+            //!        frequent forms of real text, on all hardware threads.
+            //! @return number of corrections in the store afterwards
+            OSPELL_API size_t populate_suggestion_store(
+                const std::vector<std::string>& wordforms);
+            //! @brief learn which of the given word forms are spelled
+            //!        correctly, so spell() answers for them at once.
+            //!
+            //! Meant for the most frequent forms of real text, misspelled
+            //! ones included. Replaces earlier known forms; other threads
+            //! may spell meanwhile.
+            //! @return number of forms kept
+            OSPELL_API size_t set_known_forms(
+                const std::vector<std::string>& wordforms);
             //! @brief construct speller from named file containing valid
             //!        zhfst archive.
             OSPELL_API void read_zhfst(const std::string& filename);
 
+            //! @brief save the automata of the speller, as read and
+            //!        prepared for searching, as an ospell image at
+            //!        @a path, for read_image() to use without parsing.
+            //!
+            //! The image holds the default acceptor and error model but
+            //! not the metadata, and is for machines of the same byte
+            //! order as this one.
+            OSPELL_API void save_image(const std::string& path);
+            //! @brief construct speller from the ospell image at @a path,
+            //!        searching its tables in place in a mapping of the file.
+            OSPELL_API void read_image(const std::string& path);
+            //! @brief whether the file at @a path is an ospell image rather
+            //!        than e.g. a zhfst archive.
+            OSPELL_API static bool is_image(const std::string& path);
+
             //! @brief  check if the given word is spelled correctly
             OSPELL_API bool spell(const std::string& wordform);
             //! @brief construct an ordered set of corrections for misspelled
             //!        word form.
             OSPELL_API CorrectionQueue suggest(const std::string& wordform);
+            //! @brief construct an ordered set of the best corrections
+            //!        for misspelled word form found before @a deadline.
+            //!
+            //! @a truncated tells whether the deadline cut the search
+            //! short, so that better corrections may have been missed.
+            OSPELL_API CorrectionQueue suggest(const std::string& wordform,
+                                               Deadline deadline,
+                                               bool& truncated);
+            //! @brief start giving corrections for misspelled word form
+            //!        one by one, cheapest first, as soon as each is known.
+            //!
+            //! The settings are those of suggest(), except that the search
+            //! is always best first. The caller deletes the stream.
+            OSPELL_API SuggestionStream* suggest_stream(
+                const std::string& wordform);
+            //! @brief check each of the given word forms, as spell() does
+            OSPELL_API std::vector<bool> spell_batch(
+                const std::vector<std::string>& wordforms);
+            //! @brief construct corrections for each of the given word
+            //!        forms, as suggest() does, in the same order
+            OSPELL_API std::vector<CorrectionQueue> suggest_batch(
+                const std::vector<std::string>& wordforms);
             //! @brief analyse word form morphologically
             //! @param wordform   the string to analyse
             //! @param ask_sugger whether to use the spelling correction model
@@ -102,16 +264,25 @@ namespace hfst_ospell
             //!        programmer to debug
             std::string metadata_dump() const;
         private:
+            //! @brief batch speller runs searches with our automata and
+            //!        settings
+            friend class BatchSpeller;
             //! @brief file or path where the speller came from
             std::string filename_;
             //! @brief upper bound for suggestions generated and given
-            unsigned long suggestions_maximum_;
+            std::atomic<unsigned long> suggestions_maximum_;
             //! @brief upper bound for suggestion weight generated and given
-            Weight maximum_weight_;
+            std::atomic<Weight> maximum_weight_;
             //! @brief upper bound for search beam around best candidate
-            Weight beam_;
+            std::atomic<Weight> beam_;
             //! @brief upper bound for search time in seconds
-            float time_cutoff_;
+            std::atomic<float> time_cutoff_;
+            //! @brief whether to search corrections best first
+            std::atomic<bool> best_first_;
+            //! @brief threads to split one correction search over
+            std::atomic<unsigned int> parallel_threads_;
+            //! @brief shortest word form to split the search for
+            std::atomic<unsigned int> parallel_min_length_;
             //! @brief whether automatons loaded yet can be used to check
             //!        spelling
             bool can_spell_;
@@ -138,6 +309,59 @@ namespace hfst_ospell
             Transducer* current_hyphenator_;
             //! @brief the metadata of loaded speller
             ZHfstOspellerXmlMetadata metadata_;
+            //! @brief the ospell image the automata are read from, or 0
+            MappedFile* image_;
+            //! @brief recent results of suggest()
+            ResultCache<CorrectionQueue> suggestion_cache_;
+            //! @brief recent results of analyse()
+            ResultCache<AnalysisQueue> analysis_cache_;
+            //! @brief corrections kept across processes, or empty;
+            //!        replaced whole with atomic_store() and read with
+            //!        atomic_load(), so that searches keep the store they
+            //!        started with open
+            std::shared_ptr<SuggestionStore> suggestion_store_;
+            //! @brief thread of prebuild_cache(), if running
+            std::thread cache_builder_;
+            //! @brief tells cache_builder_ to stop early
+            std::atomic<bool> stop_cache_builder_;
+            //! @brief guards cache_builder_, which prebuild_cache() and
+            //!        stop_prebuilding() may be called for at once
+            std::mutex cache_builder_mutex_;
+
+            //! @brief the settings of one search, read once so that the
+            //!        results are cached under the settings they're for
+            struct SearchSettings
+              {
+                unsigned long suggestions_maximum;
+                Weight maximum_weight;
+                Weight beam;
+                float time_cutoff;
+                bool best_first;
+                unsigned int parallel_threads;
+                unsigned int parallel_min_length;
+              };
+            //! @brief the settings as they are now
+            SearchSettings search_settings() const;
+            //! @brief stop and wait for cache_builder_, if running
+            void stop_prebuilding();
+            //! @brief stop_prebuilding() with cache_builder_mutex_ held
+            void join_cache_builder();
+            //! @brief delete the spellers and automata loaded
+            void clear_automata();
+            //! @brief checksum of the archive read last
+            uint64_t archive_checksum() const;
+
+            //! @brief corrections for @a wordform found in @a context with
+            //!        @a settings by @a deadline, from or into the
+            //!        suggestion cache and store.
+            //!
+            //! @a truncated tells whether the deadline cut the search
+            //! short; such results aren't cached or stored.
+            CorrectionQueue correct_in(SearchContext* context,
+                                       const SearchSettings& settings,
+                                       const std::string& wordform,
+                                       std::vector<char>& buffer,
+                                       Deadline deadline, bool& truncated);
       };
 
     //! @brief Top-level exception for zhfst handling.
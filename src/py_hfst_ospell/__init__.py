@@ -225,12 +225,35 @@ class ResVector(object):
 # Register ResVector in _py_hfst_ospell:
 _py_hfst_ospell.ResVector_swigregister(ResVector)
 
+class Suggestions(object):
+    thisown = property(lambda x: x.this.own(), lambda x, v: x.this.own(v), doc="The membership flag")
+
+    def __init__(self, *args, **kwargs):
+        raise AttributeError("No constructor defined")
+    __repr__ = _swig_repr
+    __swig_destroy__ = _py_hfst_ospell.delete_Suggestions
+
+    def next(self):
+        return _py_hfst_ospell.Suggestions_next(self)
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        found, correction, weight = self.next()
+        if not found:
+            raise StopIteration
+        return correction, weight
+
+# Register Suggestions in _py_hfst_ospell:
+_py_hfst_ospell.Suggestions_swigregister(Suggestions)
+
 class Speller(object):
     thisown = property(lambda x: x.this.own(), lambda x, v: x.this.own(v), doc="The membership flag")
     __repr__ = _swig_repr
 
-    def __init__(self, lex_path, error_path):
-        _py_hfst_ospell.Speller_swiginit(self, _py_hfst_ospell.new_Speller(lex_path, error_path))
+    def __init__(self, *args):
+        _py_hfst_ospell.Speller_swiginit(self, _py_hfst_ospell.new_Speller(*args))
 
     def do_suggest(self, str):
         return _py_hfst_ospell.Speller_do_suggest(self, str)
@@ -246,6 +269,27 @@ class Speller(object):
 
     def suggest_weighted(self, str):
         return _py_hfst_ospell.Speller_suggest_weighted(self, str)
+
+    def suggest_within(self, str, milliseconds):
+        return _py_hfst_ospell.Speller_suggest_within(self, str, milliseconds)
+
+    def suggest_weighted_within(self, str, milliseconds):
+        return _py_hfst_ospell.Speller_suggest_weighted_within(self, str, milliseconds)
+
+    def suggest_stream(self, str):
+        val = _py_hfst_ospell.Speller_suggest_stream(self, str)
+        # the stream searches the speller's automata
+        val._speller = self
+        return val
+
+    def spell_batch(self, strs):
+        return _py_hfst_ospell.Speller_spell_batch(self, strs)
+
+    def suggest_batch(self, strs):
+        return _py_hfst_ospell.Speller_suggest_batch(self, strs)
+
+    def suggest_weighted_batch(self, strs):
+        return _py_hfst_ospell.Speller_suggest_weighted_batch(self, strs)
     
     def lookup(self, word):
         return _py_hfst_ospell.Speller_lookup(self, word)
@@ -258,6 +302,48 @@ class Speller(object):
 
     def set_queue_limit(self, limit):
         return _py_hfst_ospell.Speller_set_queue_limit(self, limit)
+
+    def set_best_first(self, best_first):
+        return _py_hfst_ospell.Speller_set_best_first(self, best_first)
+
+    def set_known_forms(self, strs):
+        return _py_hfst_ospell.Speller_set_known_forms(self, strs)
+
+    def set_cache_size(self, suggestions):
+        return _py_hfst_ospell.Speller_set_cache_size(self, suggestions)
+
+    def set_prefix_cache(self, depth, bytes):
+        return _py_hfst_ospell.Speller_set_prefix_cache(self, depth, bytes)
+
+    def prebuild_cache(self, in_background):
+        return _py_hfst_ospell.Speller_prebuild_cache(self, in_background)
+
+    def save_cache(self, path):
+        return _py_hfst_ospell.Speller_save_cache(self, path)
+
+    def load_cache(self, path):
+        return _py_hfst_ospell.Speller_load_cache(self, path)
+
+    def save_image(self, path):
+        return _py_hfst_ospell.Speller_save_image(self, path)
+
+    def suggestion_cache_hits(self):
+        return _py_hfst_ospell.Speller_suggestion_cache_hits(self)
+
+    def suggestion_cache_misses(self):
+        return _py_hfst_ospell.Speller_suggestion_cache_misses(self)
+
+    def set_parallel_correction(self, threads, min_length):
+        return _py_hfst_ospell.Speller_set_parallel_correction(self, threads, min_length)
+
+    def open_suggestion_store(self, path):
+        return _py_hfst_ospell.Speller_open_suggestion_store(self, path)
+
+    def close_suggestion_store(self):
+        return _py_hfst_ospell.Speller_close_suggestion_store(self)
+
+    def populate_suggestion_store(self, strs):
+        return _py_hfst_ospell.Speller_populate_suggestion_store(self, strs)
     __swig_destroy__ = _py_hfst_ospell.delete_Speller
 
 # Register Speller in _py_hfst_ospell:
@@ -13,20 +13,34 @@
 //  limitations under the License.
 
 #include "hfst-ol.h"
+#include <new>
 #include <string>
 #if HAVE_CONFIG_H
 #  include <config.h>
 #endif
 
-namespace hfst_ospell {
+#if defined(__x86_64__) || defined(_M_X64) || \
+    (defined(__i386__) && defined(__SSE2__))
+#  define OSPELL_RUN_SCAN_X86 1
+#  include <immintrin.h>
+#  ifdef _MSC_VER
+#    include <intrin.h>
+#  endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(__aarch64__)
+#  define OSPELL_RUN_SCAN_NEON 1
+#  include <arm_neon.h>
+#endif
 
-template <typename T>
-inline T hfst_deref(T* ptr)
-{
-    T dest;
-    memcpy(&dest, ptr, sizeof(dest));
-    return dest;
-}
+#ifndef _WIN32
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#else
+#  include <io.h>
+#endif
+
+namespace hfst_ospell {
 
 void skip_c_string(char ** raw)
 {
@@ -36,6 +50,93 @@ void skip_c_string(char ** raw)
     ++(*raw);
 }
 
+void put_u32(std::string & blob, uint32_t number)
+{
+    blob.append(reinterpret_cast<const char *>(&number), sizeof(number));
+}
+
+void put_weight(std::string & blob, Weight weight)
+{
+    blob.append(reinterpret_cast<const char *>(&weight), sizeof(weight));
+}
+
+void put_string(std::string & blob, const std::string & s)
+{
+    put_u32(blob, static_cast<uint32_t>(s.size()));
+    blob.append(s);
+}
+
+void put_column(std::string & blob, const void * data, size_t length)
+{
+    blob.append((COLUMN_ALIGNMENT - blob.size() % COLUMN_ALIGNMENT) %
+                COLUMN_ALIGNMENT, '\0');
+    blob.append(static_cast<const char *>(data), length);
+}
+
+bool get_u32(const char ** raw, const char * end, uint32_t & number)
+{
+    if (static_cast<size_t>(end - *raw) < sizeof(number)) {
+        return false;
+    }
+    memcpy(&number, *raw, sizeof(number));
+    *raw += sizeof(number);
+    return true;
+}
+
+bool get_weight(const char ** raw, const char * end, Weight & weight)
+{
+    if (static_cast<size_t>(end - *raw) < sizeof(weight)) {
+        return false;
+    }
+    memcpy(&weight, *raw, sizeof(weight));
+    *raw += sizeof(weight);
+    return true;
+}
+
+ImageReader::ImageReader(char * data, size_t length):
+    base(data),
+    position(data),
+    end(data + length)
+{}
+
+uint32_t ImageReader::read_u32()
+{
+    uint32_t number;
+    memcpy(&number, read_bytes(sizeof(number)), sizeof(number));
+    return number;
+}
+
+Weight ImageReader::read_weight()
+{
+    Weight weight;
+    memcpy(&weight, read_bytes(sizeof(weight)), sizeof(weight));
+    return weight;
+}
+
+std::string ImageReader::read_string()
+{
+    uint32_t length = read_u32();
+    return std::string(read_bytes(length), length);
+}
+
+char * ImageReader::read_bytes(size_t length)
+{
+    if (length > static_cast<size_t>(end - position)) {
+        HFSTOSPELL_THROW(ImageReadingException);
+    }
+    char * bytes = position;
+    position += length;
+    return bytes;
+}
+
+char * ImageReader::read_column(size_t length)
+{
+    size_t padding = (COLUMN_ALIGNMENT -
+                      (position - base) % COLUMN_ALIGNMENT) % COLUMN_ALIGNMENT;
+    read_bytes(padding);
+    return read_bytes(length);
+}
+
 bool is_big_endian()
 {
 #ifdef WORDS_BIGENDIAN
@@ -108,6 +209,113 @@ float read_float_flipping_endianness(FILE * f)
     return flipper.f;
 }
 
+MappedFile::MappedFile(const std::string & filename):
+    data(NULL),
+    data_length(0)
+{
+#ifndef _WIN32
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        HFSTOSPELL_THROW_MESSAGE(FileMappingException,
+                                 "Could not open " + filename);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        HFSTOSPELL_THROW_MESSAGE(FileMappingException,
+                                 "Could not stat " + filename);
+    }
+    data_length = static_cast<size_t>(st.st_size);
+    if (data_length == 0) {
+        close(fd);
+        HFSTOSPELL_THROW_MESSAGE(FileMappingException,
+                                 "Nothing to map in " + filename);
+    }
+    void * mapping = mmap(NULL, data_length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        HFSTOSPELL_THROW_MESSAGE(FileMappingException,
+                                 "Could not map " + filename);
+    }
+    data = static_cast<char *>(mapping);
+#else
+    // No mmap here, settle for reading the file into memory
+    FILE * f = fopen(filename.c_str(), "rb");
+    if (f == NULL) {
+        HFSTOSPELL_THROW_MESSAGE(FileMappingException,
+                                 "Could not open " + filename);
+    }
+    long end = -1;
+    if (fseek(f, 0, SEEK_END) == 0) {
+        end = ftell(f);
+    }
+    if (end <= 0) {
+        fclose(f);
+        HFSTOSPELL_THROW_MESSAGE(FileMappingException,
+                                 "Nothing to map in " + filename);
+    }
+    data_length = static_cast<size_t>(end);
+    data = static_cast<char *>(malloc(data_length));
+    if (fseek(f, 0, SEEK_SET) != 0 ||
+        fread(data, data_length, 1, f) != 1) {
+        fclose(f);
+        free(data);
+        HFSTOSPELL_THROW_MESSAGE(FileMappingException,
+                                 "Could not read " + filename);
+    }
+    fclose(f);
+#endif
+}
+
+MappedFile::MappedFile(int fd, size_t length):
+    data(NULL),
+    data_length(length)
+{
+    if (length == 0) {
+        HFSTOSPELL_THROW_MESSAGE(FileMappingException,
+                                 "Nothing to map");
+    }
+#ifndef _WIN32
+    void * mapping = mmap(NULL, data_length, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        HFSTOSPELL_THROW_MESSAGE(FileMappingException,
+                                 "Could not map file");
+    }
+    data = static_cast<char *>(mapping);
+#else
+    // No mmap here, settle for reading the file into memory
+    data = static_cast<char *>(malloc(data_length));
+    if (_lseek(fd, 0, SEEK_SET) != 0 ||
+        _read(fd, data, static_cast<unsigned int>(data_length)) !=
+        static_cast<int>(data_length)) {
+        free(data);
+        HFSTOSPELL_THROW_MESSAGE(FileMappingException,
+                                 "Could not read file");
+    }
+#endif
+}
+
+MappedFile::~MappedFile(void)
+{
+#ifndef _WIN32
+    munmap(data, data_length);
+#else
+    free(data);
+#endif
+}
+
+char *
+MappedFile::get_data(void) const
+{
+    return data;
+}
+
+size_t
+MappedFile::size(void) const
+{
+    return data_length;
+}
+
 void
 TransducerHeader::read_property(bool& property, FILE* f)
 {
@@ -135,13 +343,28 @@ TransducerHeader::read_property(bool& property, FILE* f)
     }
 }
 
+// Check that @a length more bytes of raw data at @a raw end by
+// @a raw_end, if there is one to check against
+static inline void
+check_header_bytes(const char * raw, const char * raw_end, size_t length)
+{
+    if (raw_end != NULL && (raw > raw_end ||
+                            static_cast<size_t>(raw_end - raw) < length)) {
+        HFSTOSPELL_THROW_MESSAGE(HeaderParsingException,
+                                 "Header ended unexpectedly\n");
+    }
+}
+
 void
-TransducerHeader::read_property(bool& property, char** raw)
+TransducerHeader::read_property(bool& property, char** raw,
+                                const char* raw_end)
 {
+    check_header_bytes(*raw, raw_end, sizeof(uint32_t));
     if (is_big_endian()) {
         property = !(**raw == 0);
     } else {
-        unsigned int prop = *((unsigned int *) *raw);
+        unsigned int prop;
+        memcpy(&prop, *raw, sizeof(prop));
         property = !(prop == 0);
     }
     (*raw) += sizeof(uint32_t);
@@ -207,14 +430,15 @@ void TransducerHeader::skip_hfst3_header(FILE * f)
     }
 }
 
-void TransducerHeader::skip_hfst3_header(char ** raw)
+void TransducerHeader::skip_hfst3_header(char ** raw, const char * raw_end)
 {
     const char* header1 = "HFST";
     unsigned int header_loc = 0; // how much of the header has been found
 
     for(header_loc = 0; header_loc < strlen(header1) + 1; header_loc++)
     {
-        if(**raw != header1[header_loc]) {
+        if ((raw_end != NULL && *raw >= raw_end) ||
+            **raw != header1[header_loc]) {
             //std::cerr << header_loc << ": " << int(**raw) << " != " << header1[header_loc] << std::endl;
             break;
         }
@@ -223,20 +447,21 @@ void TransducerHeader::skip_hfst3_header(char ** raw)
     if(header_loc == strlen(header1) + 1) // we found it
     {
         uint16_t remaining_header_len = 0;
+        check_header_bytes(*raw, raw_end, sizeof(uint16_t));
         if (is_big_endian()) {
             remaining_header_len = read_uint16_flipping_endianness(*raw);
         } else {
-            remaining_header_len = *((unsigned short *) *raw);
+            memcpy(&remaining_header_len, *raw, sizeof(uint16_t));
         }
         //std::cerr << "remaining_header_len " << remaining_header_len << std::endl;
+        check_header_bytes(*raw, raw_end,
+                           sizeof(uint16_t) + 1 + remaining_header_len);
         (*raw) += sizeof(uint16_t) + 1 + remaining_header_len;
     } else // nope. put back what we've taken
     {
-        --(*raw); // first the non-matching character
-        for(int i = header_loc - 1; i>=0; i--) {
-            // then the characters that did match (if any)
-            --(*raw);
-        }
+        // the non-matching character was never stepped over, so only
+        // the characters that did match (if any) are put back
+        (*raw) -= header_loc;
     }
 }
 
@@ -289,9 +514,11 @@ TransducerHeader::TransducerHeader(FILE* f)
     read_property(has_unweighted_input_epsilon_cycles,f);
 }
 
-TransducerHeader::TransducerHeader(char** raw)
+TransducerHeader::TransducerHeader(char** raw, const char* raw_end)
 {
-    skip_hfst3_header(raw); // skip header iff it is present
+    skip_hfst3_header(raw, raw_end); // skip header iff it is present
+    check_header_bytes(*raw, raw_end, 2 * sizeof(SymbolNumber) +
+                       4 * sizeof(TransitionTableIndex));
     if (is_big_endian()) {
         number_of_input_symbols = read_uint16_flipping_endianness(*raw);
         (*raw) += sizeof(SymbolNumber);
@@ -306,17 +533,19 @@ TransducerHeader::TransducerHeader(char** raw)
         number_of_transitions = read_uint32_flipping_endianness(*raw);
         (*raw) += sizeof(TransitionTableIndex);
     } else {
-        number_of_input_symbols = *(SymbolNumber*) *raw;
+        memcpy(&number_of_input_symbols, *raw, sizeof(SymbolNumber));
         (*raw) += sizeof(SymbolNumber);
-        number_of_symbols = *(SymbolNumber*) *raw;
+        memcpy(&number_of_symbols, *raw, sizeof(SymbolNumber));
         (*raw) += sizeof(SymbolNumber);
-        size_of_transition_index_table = *(TransitionTableIndex*) *raw;
+        memcpy(&size_of_transition_index_table, *raw,
+               sizeof(TransitionTableIndex));
         (*raw) += sizeof(TransitionTableIndex);
-        size_of_transition_target_table = *(TransitionTableIndex*) *raw;
+        memcpy(&size_of_transition_target_table, *raw,
+               sizeof(TransitionTableIndex));
         (*raw) += sizeof(TransitionTableIndex);
-        number_of_states = *(TransitionTableIndex*) *raw;
+        memcpy(&number_of_states, *raw, sizeof(TransitionTableIndex));
         (*raw) += sizeof(TransitionTableIndex);
-        number_of_transitions = *(TransitionTableIndex*) *raw;
+        memcpy(&number_of_transitions, *raw, sizeof(TransitionTableIndex));
         (*raw) += sizeof(TransitionTableIndex);
     }
     /*
@@ -327,15 +556,54 @@ TransducerHeader::TransducerHeader(char** raw)
     std::cerr << "number_of_states " << number_of_states << std::endl;
     std::cerr << "number_of_transitions " << number_of_transitions << std::endl;
     //*/
-    read_property(weighted,raw);
-    read_property(deterministic,raw);
-    read_property(input_deterministic,raw);
-    read_property(minimized,raw);
-    read_property(cyclic,raw);
-    read_property(has_epsilon_epsilon_transitions,raw);
-    read_property(has_input_epsilon_transitions,raw);
-    read_property(has_input_epsilon_cycles,raw);
-    read_property(has_unweighted_input_epsilon_cycles,raw);
+    read_property(weighted,raw,raw_end);
+    read_property(deterministic,raw,raw_end);
+    read_property(input_deterministic,raw,raw_end);
+    read_property(minimized,raw,raw_end);
+    read_property(cyclic,raw,raw_end);
+    read_property(has_epsilon_epsilon_transitions,raw,raw_end);
+    read_property(has_input_epsilon_transitions,raw,raw_end);
+    read_property(has_input_epsilon_cycles,raw,raw_end);
+    read_property(has_unweighted_input_epsilon_cycles,raw,raw_end);
+}
+
+TransducerHeader::TransducerHeader(ImageReader & image)
+{
+    number_of_input_symbols = static_cast<SymbolNumber>(image.read_u32());
+    number_of_symbols = static_cast<SymbolNumber>(image.read_u32());
+    size_of_transition_index_table = image.read_u32();
+    size_of_transition_target_table = image.read_u32();
+    number_of_states = image.read_u32();
+    number_of_transitions = image.read_u32();
+    bool * properties[] = {
+        &weighted, &deterministic, &input_deterministic, &minimized, &cyclic,
+        &has_epsilon_epsilon_transitions, &has_input_epsilon_transitions,
+        &has_input_epsilon_cycles, &has_unweighted_input_epsilon_cycles
+    };
+    uint32_t bits = image.read_u32();
+    for (size_t i = 0; i < sizeof(properties) / sizeof(properties[0]); ++i) {
+        *properties[i] = ((bits >> i) & 1) != 0;
+    }
+}
+
+void TransducerHeader::write(std::string & blob) const
+{
+    put_u32(blob, number_of_input_symbols);
+    put_u32(blob, number_of_symbols);
+    put_u32(blob, size_of_transition_index_table);
+    put_u32(blob, size_of_transition_target_table);
+    put_u32(blob, number_of_states);
+    put_u32(blob, number_of_transitions);
+    const bool properties[] = {
+        weighted, deterministic, input_deterministic, minimized, cyclic,
+        has_epsilon_epsilon_transitions, has_input_epsilon_transitions,
+        has_input_epsilon_cycles, has_unweighted_input_epsilon_cycles
+    };
+    uint32_t bits = 0;
+    for (size_t i = 0; i < sizeof(properties) / sizeof(properties[0]); ++i) {
+        bits |= (properties[i] ? 1u : 0u) << i;
+    }
+    put_u32(blob, bits);
 }
 
 SymbolNumber
@@ -473,10 +741,9 @@ void TransducerAlphabet::read(FILE * f, SymbolNumber number_of_symbols)
                 }
 
                 operations.insert(
-                    std::pair<SymbolNumber, FlagDiacriticOperation>(
-                        k,
-                        FlagDiacriticOperation(
-                            op, feature_bucket[feat], value_bucket[val])));
+                    k,
+                    FlagDiacriticOperation(
+                        op, feature_bucket[feat], value_bucket[val]));
 
                 kt.push_back(std::string(""));
                 continue;
@@ -501,7 +768,20 @@ void TransducerAlphabet::read(FILE * f, SymbolNumber number_of_symbols)
     flag_state_size = static_cast<SymbolNumber>(feature_bucket.size());
 }
 
-void TransducerAlphabet::read(char ** raw, SymbolNumber number_of_symbols)
+// Check that a whole symbol string starts at @a raw before @a raw_end, if
+// there is one to check against
+static inline void
+check_symbol_string(const char * raw, const char * raw_end)
+{
+    if (raw_end != NULL &&
+        (raw >= raw_end || memchr(raw, '\0', raw_end - raw) == NULL)) {
+        HFSTOSPELL_THROW_MESSAGE(AlphabetParsingException,
+                                 "Alphabet ended unexpectedly\n");
+    }
+}
+
+void TransducerAlphabet::read(char ** raw, const char * raw_end,
+                              SymbolNumber number_of_symbols)
 {
     std::map<std::string, SymbolNumber> feature_bucket;
     std::map<std::string, ValueNumber> value_bucket;
@@ -510,9 +790,11 @@ void TransducerAlphabet::read(char ** raw, SymbolNumber number_of_symbols)
     SymbolNumber feat_num = 0;
 
     kt.push_back(std::string("")); // zeroth symbol is epsilon
+    check_symbol_string(*raw, raw_end);
     skip_c_string(raw);
 
     for (SymbolNumber k = 1; k < number_of_symbols; ++k) {
+        check_symbol_string(*raw, raw_end);
 
         // Detect and handle special symbols, which begin and end with @
         if ((*raw)[0] == '@' && (*raw)[strlen(*raw) - 1] == '@') {
@@ -546,10 +828,9 @@ void TransducerAlphabet::read(char ** raw, SymbolNumber number_of_symbols)
                 }
 
                 operations.insert(
-                    std::pair<SymbolNumber, FlagDiacriticOperation>(
-                        k,
-                        FlagDiacriticOperation(
-                            op, feature_bucket[feat], value_bucket[val])));
+                    k,
+                    FlagDiacriticOperation(
+                        op, feature_bucket[feat], value_bucket[val]));
 
                 kt.push_back(std::string(""));
                 skip_c_string(raw);
@@ -578,6 +859,37 @@ void TransducerAlphabet::read(char ** raw, SymbolNumber number_of_symbols)
     flag_state_size = static_cast<SymbolNumber>(feature_bucket.size());
 }
 
+void FlagSymbolSet::insert(SymbolNumber symbol)
+{
+    if (symbol == NO_SYMBOL || contains(symbol)) {
+        return;
+    }
+    if (static_cast<size_t>(symbol >> 5) >= bits.size()) {
+        bits.resize((symbol >> 5) + 1, 0);
+    }
+    bits[symbol >> 5] |= 1u << (symbol & 31);
+    if (count == 0 || symbol < lowest) {
+        lowest = symbol;
+    }
+    if (count == 0 || symbol > highest) {
+        highest = symbol;
+    }
+    ++count;
+}
+
+void OperationTable::insert(SymbolNumber symbol,
+                            const FlagDiacriticOperation & op)
+{
+    if (symbol == NO_SYMBOL) {
+        return;
+    }
+    if (symbol >= by_symbol.size()) {
+        by_symbol.resize(static_cast<size_t>(symbol) + 1);
+    }
+    by_symbol[symbol] = op;
+    flag_symbols.insert(symbol);
+}
+
 TransducerAlphabet::TransducerAlphabet(FILE* f, SymbolNumber number_of_symbols):
     unknown_symbol(NO_SYMBOL),
     identity_symbol(NO_SYMBOL),
@@ -587,12 +899,92 @@ TransducerAlphabet::TransducerAlphabet(FILE* f, SymbolNumber number_of_symbols):
 }
 
 TransducerAlphabet::TransducerAlphabet(char** raw,
-                                       SymbolNumber number_of_symbols):
+                                       SymbolNumber number_of_symbols,
+                                       const char* raw_end):
     unknown_symbol(NO_SYMBOL),
     identity_symbol(NO_SYMBOL),
     orig_symbol_count(number_of_symbols)
 {
-    read(raw, number_of_symbols);
+    read(raw, raw_end, number_of_symbols);
+}
+
+TransducerAlphabet::TransducerAlphabet(ImageReader & image)
+{
+    uint32_t symbol_count = image.read_u32();
+    for (uint32_t k = 0; k < symbol_count; ++k) {
+        kt.push_back(image.read_string());
+    }
+    uint32_t string_count = image.read_u32();
+    for (uint32_t i = 0; i < string_count; ++i) {
+        std::string symbol_string = image.read_string();
+        uint32_t symbol = image.read_u32();
+        if (symbol >= symbol_count) {
+            HFSTOSPELL_THROW(ImageReadingException);
+        }
+        string_to_symbol[symbol_string] = static_cast<SymbolNumber>(symbol);
+    }
+    // the sizes come before the flags so that these can be checked
+    // against them
+    uint32_t unknown = image.read_u32();
+    uint32_t identity = image.read_u32();
+    uint32_t feature_count = image.read_u32();
+    uint32_t orig_count = image.read_u32();
+    if ((unknown >= symbol_count && unknown != NO_SYMBOL) ||
+        (identity >= symbol_count && identity != NO_SYMBOL) ||
+        feature_count > NO_SYMBOL || orig_count > symbol_count) {
+        HFSTOSPELL_THROW(ImageReadingException);
+    }
+    unknown_symbol = static_cast<SymbolNumber>(unknown);
+    identity_symbol = static_cast<SymbolNumber>(identity);
+    flag_state_size = static_cast<SymbolNumber>(feature_count);
+    orig_symbol_count = static_cast<SymbolNumber>(orig_count);
+    uint32_t flag_count = image.read_u32();
+    for (uint32_t i = 0; i < flag_count; ++i) {
+        uint32_t symbol = image.read_u32();
+        uint32_t op = image.read_u32();
+        uint32_t feature = image.read_u32();
+        uint32_t value = image.read_u32();
+        // features index the flag state, which has flag_state_size slots
+        if (symbol >= symbol_count || op > U || feature >= feature_count) {
+            HFSTOSPELL_THROW(ImageReadingException);
+        }
+        operations.insert(static_cast<SymbolNumber>(symbol),
+                          FlagDiacriticOperation(
+                              static_cast<FlagDiacriticOperator>(op),
+                              static_cast<SymbolNumber>(feature),
+                              static_cast<ValueNumber>(value)));
+    }
+}
+
+void TransducerAlphabet::write(std::string & blob) const
+{
+    put_u32(blob, static_cast<uint32_t>(kt.size()));
+    for (auto & symbol_string : kt) {
+        put_string(blob, symbol_string);
+    }
+    put_u32(blob, static_cast<uint32_t>(string_to_symbol.size()));
+    for (auto & entry : string_to_symbol) {
+        put_string(blob, entry.first);
+        put_u32(blob, entry.second);
+    }
+    put_u32(blob, unknown_symbol);
+    put_u32(blob, identity_symbol);
+    put_u32(blob, flag_state_size);
+    put_u32(blob, orig_symbol_count);
+    std::vector<SymbolNumber> flags;
+    for (size_t k = 0; k < kt.size(); ++k) {
+        if (operations.is_flag(static_cast<SymbolNumber>(k))) {
+            flags.push_back(static_cast<SymbolNumber>(k));
+        }
+    }
+    put_u32(blob, static_cast<uint32_t>(flags.size()));
+    for (auto flag : flags) {
+        const FlagDiacriticOperation * op = operations.find(flag);
+        put_u32(blob, flag);
+        put_u32(blob, op->Operation());
+        put_u32(blob, op->Feature());
+        put_u32(blob, static_cast<uint32_t>(op->Value()));
+    }
 }
 
 void TransducerAlphabet::add_symbol(std::string & sym)
@@ -613,12 +1005,18 @@ TransducerAlphabet::get_key_table()
     return &kt;
 }
 
-OperationMap*
-TransducerAlphabet::get_operation_map()
+const OperationTable*
+TransducerAlphabet::get_operation_table() const
 {
     return &operations;
 }
 
+const FlagSymbolSet &
+TransducerAlphabet::get_flag_symbols() const
+{
+    return operations.get_flag_symbols();
+}
+
 SymbolNumber
 TransducerAlphabet::get_state_size()
 {
@@ -654,47 +1052,150 @@ bool TransducerAlphabet::has_string(std::string const & s) const
 }
 
 bool
-TransducerAlphabet::is_flag(SymbolNumber symbol)
+TransducerAlphabet::is_flag(SymbolNumber symbol) const
+{
+    return operations.is_flag(symbol);
+}
+
+// The tables are stored in the file as little-endian records; in memory
+// each field gets a column of its own, aligned to a cache line.
+
+static inline uint16_t
+read_le16(const char * p)
+{
+    const unsigned char * b = reinterpret_cast<const unsigned char *>(p);
+    return static_cast<uint16_t>(b[0] | (b[1] << 8));
+}
+
+static inline uint32_t
+read_le32(const char * p)
+{
+    const unsigned char * b = reinterpret_cast<const unsigned char *>(p);
+    return static_cast<uint32_t>(b[0]) |
+        (static_cast<uint32_t>(b[1]) << 8) |
+        (static_cast<uint32_t>(b[2]) << 16) |
+        (static_cast<uint32_t>(b[3]) << 24);
+}
+
+static inline size_t
+column_bytes(size_t entries, size_t width)
 {
-    return operations.count(symbol) == 1;
+    return (entries * width + COLUMN_ALIGNMENT - 1) &
+        ~(COLUMN_ALIGNMENT - 1);
+}
+
+// Allocate @a bytes aligned to a cache line, with the offset to the start
+// of the malloc'd block stored just before the returned pointer.
+static char *
+allocate_aligned(size_t bytes)
+{
+    char * block = static_cast<char *>(malloc(bytes + COLUMN_ALIGNMENT));
+    if (block == NULL) {
+        throw std::bad_alloc();
+    }
+    size_t offset = COLUMN_ALIGNMENT -
+        (reinterpret_cast<uintptr_t>(block) & (COLUMN_ALIGNMENT - 1));
+    char * aligned = block + offset;
+    aligned[-1] = static_cast<char>(offset);
+    return aligned;
+}
+
+// Columns of images are used in place when they're aligned as they
+// would be if allocated here.
+static inline bool
+is_aligned(const char * column)
+{
+    return reinterpret_cast<uintptr_t>(column) % COLUMN_ALIGNMENT == 0;
+}
+
+static void
+free_aligned(char * aligned)
+{
+    if (aligned != NULL) {
+        free(aligned - static_cast<unsigned char>(aligned[-1]));
+    }
+}
+
+void IndexTable::allocate(TransitionTableIndex number_of_table_entries)
+{
+    size_t symbol_bytes = column_bytes(number_of_table_entries,
+                                       sizeof(SymbolNumber));
+    storage = allocate_aligned(symbol_bytes +
+                               column_bytes(number_of_table_entries,
+                                            sizeof(TransitionTableIndex)));
+    input_symbols = reinterpret_cast<SymbolNumber *>(storage);
+    targets = reinterpret_cast<TransitionTableIndex *>(storage +
+                                                       symbol_bytes);
+}
+
+void IndexTable::convert(const char * records)
+{
+    for (TransitionTableIndex i = 0; i < size; ++i) {
+        const char * record = records + i * TransitionIndex::SIZE;
+        input_symbols[i] = read_le16(record);
+        targets[i] = read_le32(record + sizeof(SymbolNumber));
+    }
 }
 
 void IndexTable::read(FILE * f,
                       TransitionTableIndex number_of_table_entries)
 {
     size_t table_size = number_of_table_entries*TransitionIndex::SIZE;
-    indices = (char*)(malloc(table_size));
-    if (fread(indices,table_size, 1, f) != 1) {
+    std::vector<char> records(table_size);
+    if (table_size != 0 && fread(&records[0], table_size, 1, f) != 1) {
         HFSTOSPELL_THROW(IndexTableReadingException);
     }
-    if (is_big_endian()) {
-        convert_to_big_endian();
-    }
+    allocate(number_of_table_entries);
+    convert(records.data());
 }
 
 void IndexTable::read(char ** raw,
                       TransitionTableIndex number_of_table_entries)
+{
+    allocate(number_of_table_entries);
+    convert(*raw);
+    (*raw) += number_of_table_entries*TransitionIndex::SIZE;
+}
+
+void IndexTable::read(char ** raw, const char * raw_end,
+                      TransitionTableIndex number_of_table_entries)
 {
     size_t table_size = number_of_table_entries*TransitionIndex::SIZE;
-    indices = (char*)(malloc(table_size));
-    memcpy((void *) indices, (const void *) *raw, table_size);
-    (*raw) += table_size;
-    if (is_big_endian()) {
-        convert_to_big_endian();
+    if (table_size > static_cast<size_t>(raw_end - *raw)) {
+        HFSTOSPELL_THROW(IndexTableReadingException);
     }
+    read(raw, number_of_table_entries);
 }
 
-void IndexTable::convert_to_big_endian()
+void TransitionTable::allocate(TransitionTableIndex number_of_table_entries)
+{
+    size_t symbol_bytes = column_bytes(number_of_table_entries + PADDING,
+                                       sizeof(SymbolNumber));
+    size_t target_bytes = column_bytes(number_of_table_entries,
+                                       sizeof(TransitionTableIndex));
+    storage = allocate_aligned(2 * symbol_bytes + 2 * target_bytes);
+    input_symbols = reinterpret_cast<SymbolNumber *>(storage);
+    output_symbols = reinterpret_cast<SymbolNumber *>(storage +
+                                                      symbol_bytes);
+    targets = reinterpret_cast<TransitionTableIndex *>(storage +
+                                                       2 * symbol_bytes);
+    weights = reinterpret_cast<Weight *>(storage + 2 * symbol_bytes +
+                                         target_bytes);
+    for (size_t i = 0; i < PADDING; ++i) {
+        input_symbols[number_of_table_entries + i] = NO_SYMBOL;
+    }
+}
+
+void TransitionTable::convert(const char * records)
 {
-    //std::cerr << "IndexTable::convert_to_big_endian " << size << std::endl;
-    // We have a sequence of uint_16's and uint_32's in memory,
-    // and we're going to flip endianness of each one.
-    for(size_t i = 0; i < size; ++i) {
-        // first the uint_16
-        std::swap(*(indices + i * TransitionIndex::SIZE + 0), *(indices + i * TransitionIndex::SIZE + 1));
-        // then the uint_32
-        std::swap(*(indices + i * TransitionIndex::SIZE + 2), *(indices + i * TransitionIndex::SIZE + 5));
-        std::swap(*(indices + i * TransitionIndex::SIZE + 3), *(indices + i * TransitionIndex::SIZE + 4));
+    for (TransitionTableIndex i = 0; i < size; ++i) {
+        const char * record = records + i * Transition::SIZE;
+        input_symbols[i] = read_le16(record);
+        output_symbols[i] = read_le16(record + sizeof(SymbolNumber));
+        targets[i] = read_le32(record + 2 * sizeof(SymbolNumber));
+        uint32_t weight_bits = read_le32(record + 2 * sizeof(SymbolNumber) +
+                                         sizeof(TransitionTableIndex));
+        memcpy(weights + i, &weight_bits, sizeof(Weight));
     }
 }
 
@@ -702,45 +1203,282 @@ void TransitionTable::read(FILE * f,
                            TransitionTableIndex number_of_table_entries)
 {
     size_t table_size = number_of_table_entries*Transition::SIZE;
-    transitions = (char*)(malloc(table_size));
-    if (fread(transitions, table_size, 1, f) != 1) {
+    std::vector<char> records(table_size);
+    if (table_size != 0 && fread(&records[0], table_size, 1, f) != 1) {
         HFSTOSPELL_THROW(TransitionTableReadingException);
     }
-    if (is_big_endian()) {
-        convert_to_big_endian();
-    }
+    allocate(number_of_table_entries);
+    convert(records.data());
 }
 
 void TransitionTable::read(char ** raw,
                            TransitionTableIndex number_of_table_entries)
+{
+    allocate(number_of_table_entries);
+    convert(*raw);
+    (*raw) += number_of_table_entries*Transition::SIZE;
+}
+
+void TransitionTable::read(char ** raw, const char * raw_end,
+                           TransitionTableIndex number_of_table_entries)
 {
     size_t table_size = number_of_table_entries*Transition::SIZE;
-    transitions = (char*)(malloc(table_size));
-    memcpy((void *) transitions, (const void *) *raw, table_size);
-    (*raw) += table_size;
-    if (is_big_endian()) {
-        convert_to_big_endian();
+    if (table_size > static_cast<size_t>(raw_end - *raw)) {
+        HFSTOSPELL_THROW(TransitionTableReadingException);
+    }
+    read(raw, number_of_table_entries);
+}
+
+// Scanning runs of transitions. The transitions of a state with the same
+// input symbol, and those with epsilon or flag inputs, sit next to each
+// other, so finding where such a run ends takes a few vector compares of
+// the input symbol column. The NO_SYMBOL padding after the column ends
+// every run and leaves room for a whole vector past the last transition.
+// The kernels return the offset of the first symbol from @a symbols on
+// that doesn't belong to the run; the flag kernels only check that symbols
+// are epsilon or fall in the range of flags, @a lowest to @a lowest +
+// @a span, and leave the check against the flag bits to the caller.
+
+typedef size_t (*RunScanner)(const SymbolNumber * symbols,
+                             SymbolNumber symbol);
+typedef size_t (*FlagRunScanner)(const SymbolNumber * symbols,
+                                 SymbolNumber lowest, SymbolNumber span);
+
+static size_t
+scan_run_scalar(const SymbolNumber * symbols, SymbolNumber symbol)
+{
+    size_t n = 0;
+    while (symbols[n] == symbol) {
+        ++n;
+    }
+    return n;
+}
+
+static size_t
+scan_flag_run_scalar(const SymbolNumber * symbols,
+                     SymbolNumber lowest, SymbolNumber span)
+{
+    size_t n = 0;
+    while (symbols[n] == 0 ||
+           static_cast<SymbolNumber>(symbols[n] - lowest) <= span) {
+        ++n;
+    }
+    return n;
+}
+
+#if defined(OSPELL_RUN_SCAN_X86) || defined(OSPELL_RUN_SCAN_NEON)
+static inline unsigned int
+lowest_set_bit(uint64_t mask)
+{
+#  ifdef _MSC_VER
+    unsigned long bit;
+    _BitScanForward64(&bit, mask);
+    return static_cast<unsigned int>(bit);
+#  else
+    return static_cast<unsigned int>(__builtin_ctzll(mask));
+#  endif
+}
+#endif
+
+#ifdef OSPELL_RUN_SCAN_X86
+static size_t
+scan_run_sse2(const SymbolNumber * symbols, SymbolNumber symbol)
+{
+    const __m128i wanted = _mm_set1_epi16(static_cast<short>(symbol));
+    for (size_t n = 0; ; n += 8) {
+        __m128i v = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(symbols + n));
+        unsigned int other = ~_mm_movemask_epi8(_mm_cmpeq_epi16(v, wanted))
+            & 0xFFFFu;
+        if (other != 0) {
+            return n + lowest_set_bit(other) / 2;
+        }
+    }
+}
+
+static size_t
+scan_flag_run_sse2(const SymbolNumber * symbols,
+                   SymbolNumber lowest, SymbolNumber span)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i low = _mm_set1_epi16(static_cast<short>(lowest));
+    const __m128i width = _mm_set1_epi16(static_cast<short>(span));
+    for (size_t n = 0; ; n += 8) {
+        __m128i v = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(symbols + n));
+        // v - lowest <= span, unsigned, is when the saturating difference
+        // of the two is zero
+        __m128i in_range = _mm_cmpeq_epi16(
+            _mm_subs_epu16(_mm_sub_epi16(v, low), width), zero);
+        __m128i in_run = _mm_or_si128(_mm_cmpeq_epi16(v, zero), in_range);
+        unsigned int other = ~_mm_movemask_epi8(in_run) & 0xFFFFu;
+        if (other != 0) {
+            return n + lowest_set_bit(other) / 2;
+        }
+    }
+}
+
+#  if defined(__GNUC__) || defined(__AVX2__)
+#    ifdef __GNUC__
+#      define OSPELL_TARGET_AVX2 __attribute__((target("avx2")))
+#    else
+#      define OSPELL_TARGET_AVX2
+#    endif
+#    define OSPELL_RUN_SCAN_AVX2 1
+
+OSPELL_TARGET_AVX2 static size_t
+scan_run_avx2(const SymbolNumber * symbols, SymbolNumber symbol)
+{
+    const __m256i wanted = _mm256_set1_epi16(static_cast<short>(symbol));
+    for (size_t n = 0; ; n += 16) {
+        __m256i v = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(symbols + n));
+        uint32_t other = ~static_cast<uint32_t>(
+            _mm256_movemask_epi8(_mm256_cmpeq_epi16(v, wanted)));
+        if (other != 0) {
+            return n + lowest_set_bit(other) / 2;
+        }
+    }
+}
+
+OSPELL_TARGET_AVX2 static size_t
+scan_flag_run_avx2(const SymbolNumber * symbols,
+                   SymbolNumber lowest, SymbolNumber span)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i low = _mm256_set1_epi16(static_cast<short>(lowest));
+    const __m256i width = _mm256_set1_epi16(static_cast<short>(span));
+    for (size_t n = 0; ; n += 16) {
+        __m256i v = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(symbols + n));
+        __m256i in_range = _mm256_cmpeq_epi16(
+            _mm256_subs_epu16(_mm256_sub_epi16(v, low), width), zero);
+        __m256i in_run = _mm256_or_si256(_mm256_cmpeq_epi16(v, zero),
+                                         in_range);
+        uint32_t other = ~static_cast<uint32_t>(
+            _mm256_movemask_epi8(in_run));
+        if (other != 0) {
+            return n + lowest_set_bit(other) / 2;
+        }
     }
 }
+#  endif
+#endif // OSPELL_RUN_SCAN_X86
 
-void TransitionTable::convert_to_big_endian()
+#ifdef OSPELL_RUN_SCAN_NEON
+// a byte per lane, all ones for lanes in the run
+static inline uint64_t
+lanes_in_run(uint16x8_t in_run)
 {
-    //std::cerr << "TransitionTable::convert_to_big_endian " << size << std::endl;
-    // We have a sequence of [ uint_16, uint_16, uint_32, float ] in memory,
-    // and we're going to flip endianness of each one.
-    for(size_t i = 0; i < size; ++i) {
-        // first the uint_16s
-        std::swap(*(transitions + i * Transition::SIZE + 0), *(transitions + i * Transition::SIZE + 1));
-        std::swap(*(transitions + i * Transition::SIZE + 2), *(transitions + i * Transition::SIZE + 3));
-        // then the uint_32
-        std::swap(*(transitions + i * Transition::SIZE + 4), *(transitions + i * Transition::SIZE + 7));
-        std::swap(*(transitions + i * Transition::SIZE + 5), *(transitions + i * Transition::SIZE + 6));
-        // then the float
-        std::swap(*(transitions + i * Transition::SIZE + 8), *(transitions + i * Transition::SIZE + 11));
-        std::swap(*(transitions + i * Transition::SIZE + 9), *(transitions + i * Transition::SIZE + 10));
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(in_run, 4)), 0);
+}
+
+static size_t
+scan_run_neon(const SymbolNumber * symbols, SymbolNumber symbol)
+{
+    const uint16x8_t wanted = vdupq_n_u16(symbol);
+    for (size_t n = 0; ; n += 8) {
+        uint64_t other = ~lanes_in_run(vceqq_u16(vld1q_u16(symbols + n),
+                                                 wanted));
+        if (other != 0) {
+            return n + lowest_set_bit(other) / 8;
+        }
+    }
+}
+
+static size_t
+scan_flag_run_neon(const SymbolNumber * symbols,
+                   SymbolNumber lowest, SymbolNumber span)
+{
+    const uint16x8_t zero = vdupq_n_u16(0);
+    const uint16x8_t low = vdupq_n_u16(lowest);
+    const uint16x8_t width = vdupq_n_u16(span);
+    for (size_t n = 0; ; n += 8) {
+        uint16x8_t v = vld1q_u16(symbols + n);
+        uint16x8_t in_range = vceqq_u16(vqsubq_u16(vsubq_u16(v, low), width),
+                                        zero);
+        uint64_t other = ~lanes_in_run(vorrq_u16(vceqq_u16(v, zero),
+                                                 in_range));
+        if (other != 0) {
+            return n + lowest_set_bit(other) / 8;
+        }
+    }
+}
+#endif // OSPELL_RUN_SCAN_NEON
+
+struct RunScanners
+{
+    RunScanner run;
+    FlagRunScanner flag_run;
+};
+
+// the best kernels the processor we're running on has
+static RunScanners
+select_run_scanners()
+{
+    RunScanners scanners;
+    scanners.run = scan_run_scalar;
+    scanners.flag_run = scan_flag_run_scalar;
+#if defined(OSPELL_RUN_SCAN_X86)
+    scanners.run = scan_run_sse2;
+    scanners.flag_run = scan_flag_run_sse2;
+#  if defined(OSPELL_RUN_SCAN_AVX2) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scanners.run = scan_run_avx2;
+        scanners.flag_run = scan_flag_run_avx2;
     }
+#  elif defined(OSPELL_RUN_SCAN_AVX2)
+    // built for AVX2 processors only
+    scanners.run = scan_run_avx2;
+    scanners.flag_run = scan_flag_run_avx2;
+#  endif
+#elif defined(OSPELL_RUN_SCAN_NEON)
+    scanners.run = scan_run_neon;
+    scanners.flag_run = scan_flag_run_neon;
+#endif
+    return scanners;
+}
+
+static const RunScanners &
+run_scanners()
+{
+    static const RunScanners scanners = select_run_scanners();
+    return scanners;
 }
 
+TransitionTableIndex
+TransitionTable::run_end(TransitionTableIndex i, SymbolNumber symbol) const
+{
+    if (i >= size || symbol == NO_SYMBOL) {
+        return i;
+    }
+    return i + static_cast<TransitionTableIndex>(
+        run_scanners().run(input_symbols + i, symbol));
+}
+
+TransitionTableIndex
+TransitionTable::epsilon_run_end(TransitionTableIndex i,
+                                 const FlagSymbolSet & flags) const
+{
+    if (i >= size) {
+        return i;
+    }
+    TransitionTableIndex end = i + static_cast<TransitionTableIndex>(
+        run_scanners().flag_run(input_symbols + i, flags.get_lowest(),
+                                flags.get_span()));
+    if (!flags.is_contiguous()) {
+        // symbols in the range of flags that aren't flags end the run too
+        for (TransitionTableIndex j = i; j < end; ++j) {
+            if (input_symbols[j] != 0 && !flags.contains(input_symbols[j])) {
+                return j;
+            }
+        }
+    }
+    return end;
+}
+
+
 void LetterTrie::add_string(const char * p, SymbolNumber symbol_key)
 {
     if (*(p+1) == 0)
@@ -891,7 +1629,9 @@ Transition::final() const
 
 IndexTable::IndexTable(FILE* f,
                        TransitionTableIndex number_of_table_entries):
-    indices(NULL),
+    storage(NULL),
+    input_symbols(NULL),
+    targets(NULL),
     size(number_of_table_entries)
 {
     read(f, number_of_table_entries);
@@ -899,63 +1639,62 @@ IndexTable::IndexTable(FILE* f,
 
 IndexTable::IndexTable(char ** raw,
                        TransitionTableIndex number_of_table_entries):
-    indices(NULL),
+    storage(NULL),
+    input_symbols(NULL),
+    targets(NULL),
     size(number_of_table_entries)
 {
     read(raw, number_of_table_entries);
 }
 
-IndexTable::~IndexTable()
-{
-    if (indices) {
-        free(indices);
-    }
-}
-
-SymbolNumber
-IndexTable::input_symbol(TransitionTableIndex i) const
+IndexTable::IndexTable(char ** raw, const char * raw_end,
+                       TransitionTableIndex number_of_table_entries):
+    storage(NULL),
+    input_symbols(NULL),
+    targets(NULL),
+    size(number_of_table_entries)
 {
-    if (i < size) {
-        return hfst_deref((SymbolNumber *)
-                          (indices + TransitionIndex::SIZE * i));
-    } else {
-        return NO_SYMBOL;
-    }
+    read(raw, raw_end, number_of_table_entries);
 }
 
-TransitionTableIndex
-IndexTable::target(TransitionTableIndex i) const
+IndexTable::IndexTable(ImageReader & image):
+    storage(NULL),
+    input_symbols(NULL),
+    targets(NULL),
+    size(image.read_u32())
 {
-    if (i < size) {
-        return hfst_deref((TransitionTableIndex *)
-                          (indices + TransitionIndex::SIZE * i +
-                           sizeof(SymbolNumber)));
+    char * symbol_column = image.read_column(size * sizeof(SymbolNumber));
+    char * target_column = image.read_column(size *
+                                             sizeof(TransitionTableIndex));
+    if (is_aligned(symbol_column) && is_aligned(target_column)) {
+        input_symbols = reinterpret_cast<SymbolNumber *>(symbol_column);
+        targets = reinterpret_cast<TransitionTableIndex *>(target_column);
     } else {
-        return NO_TABLE_INDEX;
+        allocate(size);
+        memcpy(input_symbols, symbol_column, size * sizeof(SymbolNumber));
+        memcpy(targets, target_column, size * sizeof(TransitionTableIndex));
     }
 }
 
-bool
-IndexTable::final(TransitionTableIndex i) const
+void IndexTable::write(std::string & blob) const
 {
-    return input_symbol(i) == NO_SYMBOL && target(i) != NO_TABLE_INDEX;
+    put_u32(blob, size);
+    put_column(blob, input_symbols, size * sizeof(SymbolNumber));
+    put_column(blob, targets, size * sizeof(TransitionTableIndex));
 }
 
-Weight
-IndexTable::final_weight(TransitionTableIndex i) const
+IndexTable::~IndexTable()
 {
-    if (i < size) {
-        return hfst_deref((Weight *)
-                          (indices + TransitionIndex::SIZE * i +
-                           sizeof(SymbolNumber)));
-    } else {
-        return INFINITE_WEIGHT;
-    }
+    free_aligned(storage);
 }
 
 TransitionTable::TransitionTable(FILE * f,
                                  TransitionTableIndex transition_count):
-    transitions(NULL),
+    storage(NULL),
+    input_symbols(NULL),
+    output_symbols(NULL),
+    targets(NULL),
+    weights(NULL),
     size(transition_count)
 {
     read(f, transition_count);
@@ -963,73 +1702,78 @@ TransitionTable::TransitionTable(FILE * f,
 
 TransitionTable::TransitionTable(char ** raw,
                                  TransitionTableIndex transition_count):
-    transitions(NULL),
+    storage(NULL),
+    input_symbols(NULL),
+    output_symbols(NULL),
+    targets(NULL),
+    weights(NULL),
     size(transition_count)
 {
     read(raw, transition_count);
 }
 
-TransitionTable::~TransitionTable()
-{
-    if (transitions) {
-        free(transitions);
-    }
-}
-
-SymbolNumber
-TransitionTable::input_symbol(TransitionTableIndex i) const
-{
-    if (i < size) {
-        return hfst_deref((SymbolNumber *)
-                          (transitions + Transition::SIZE * i));
-    } else {
-        return NO_SYMBOL;
-    }
-}
-
-SymbolNumber
-TransitionTable::output_symbol(TransitionTableIndex i) const
+TransitionTable::TransitionTable(char ** raw, const char * raw_end,
+                                 TransitionTableIndex transition_count):
+    storage(NULL),
+    input_symbols(NULL),
+    output_symbols(NULL),
+    targets(NULL),
+    weights(NULL),
+    size(transition_count)
 {
-    if (i < size) {
-        return hfst_deref((SymbolNumber *)
-                          (transitions + Transition::SIZE * i +
-                           sizeof(SymbolNumber)));
-    } else {
-        return NO_SYMBOL;
+    read(raw, raw_end, transition_count);
+}
+
+TransitionTable::TransitionTable(ImageReader & image):
+    storage(NULL),
+    input_symbols(NULL),
+    output_symbols(NULL),
+    targets(NULL),
+    weights(NULL),
+    size(image.read_u32())
+{
+    char * input_column = image.read_column((size + PADDING) *
+                                            sizeof(SymbolNumber));
+    char * output_column = image.read_column(size * sizeof(SymbolNumber));
+    char * target_column = image.read_column(size *
+                                             sizeof(TransitionTableIndex));
+    char * weight_column = image.read_column(size * sizeof(Weight));
+    // the run scans count on the padding to stop them
+    for (size_t i = 0; i < PADDING; ++i) {
+        SymbolNumber padding;
+        memcpy(&padding, input_column + (size + i) * sizeof(SymbolNumber),
+               sizeof(padding));
+        if (padding != NO_SYMBOL) {
+            HFSTOSPELL_THROW(ImageReadingException);
+        }
     }
-}
-
-TransitionTableIndex
-TransitionTable::target(TransitionTableIndex i) const
-{
-    if (i < size) {
-        return hfst_deref((TransitionTableIndex *)
-                          (transitions + Transition::SIZE * i +
-                           2*sizeof(SymbolNumber)));
+    if (is_aligned(input_column) && is_aligned(output_column) &&
+        is_aligned(target_column) && is_aligned(weight_column)) {
+        input_symbols = reinterpret_cast<SymbolNumber *>(input_column);
+        output_symbols = reinterpret_cast<SymbolNumber *>(output_column);
+        targets = reinterpret_cast<TransitionTableIndex *>(target_column);
+        weights = reinterpret_cast<Weight *>(weight_column);
     } else {
-        return NO_TABLE_INDEX;
+        allocate(size);
+        memcpy(input_symbols, input_column, size * sizeof(SymbolNumber));
+        memcpy(output_symbols, output_column, size * sizeof(SymbolNumber));
+        memcpy(targets, target_column, size * sizeof(TransitionTableIndex));
+        memcpy(weights, weight_column, size * sizeof(Weight));
     }
 }
 
-Weight
-TransitionTable::weight(TransitionTableIndex i) const
+void TransitionTable::write(std::string & blob) const
 {
-    if (i < size) {
-        return hfst_deref((Weight *)
-                          (transitions + Transition::SIZE * i +
-                           2*sizeof(SymbolNumber) +
-                           sizeof(TransitionTableIndex)));
-    } else {
-        return INFINITE_WEIGHT;
-    }
+    put_u32(blob, size);
+    put_column(blob, input_symbols, (size + PADDING) * sizeof(SymbolNumber));
+    put_column(blob, output_symbols, size * sizeof(SymbolNumber));
+    put_column(blob, targets, size * sizeof(TransitionTableIndex));
+    put_column(blob, weights, size * sizeof(Weight));
 }
 
-bool
-TransitionTable::final(TransitionTableIndex i) const
+TransitionTable::~TransitionTable()
 {
-    return input_symbol(i) == NO_SYMBOL &&
-        output_symbol(i) == NO_SYMBOL &&
-        target(i) == 1;
+    free_aligned(storage);
 }
 
 SymbolNumber Encoder::find_key(char ** p)
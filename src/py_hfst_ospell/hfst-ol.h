@@ -53,13 +53,14 @@ class FlagDiacriticOperation;
 typedef std::vector<TransitionIndex*> TransitionIndexVector;
 typedef std::vector<Transition*> TransitionVector;
 
-typedef std::map<SymbolNumber, FlagDiacriticOperation> OperationMap;
-
 const SymbolNumber NO_SYMBOL = USHRT_MAX;
 const TransitionTableIndex NO_TABLE_INDEX = UINT_MAX;
 const Weight INFINITE_WEIGHT = static_cast<float>(NO_TABLE_INDEX);
 const unsigned int MAX_SYMBOL_BYTES = 1000;
 
+// Table columns start at multiples of this, in memory and in ospell images
+const size_t COLUMN_ALIGNMENT = 64;
+
 // This is 2^31, hopefully equal to UINT_MAX/2 rounded up.
 // For some profound reason it can't be replaced with (UINT_MAX+1)/2.
 const TransitionTableIndex TARGET_TABLE = 2147483648u;
@@ -83,6 +84,75 @@ float read_float_flipping_endianness(FILE * f);
 // Utility function for dealing with raw memory
 void skip_c_string(char ** raw);
 
+// Utility functions for writing caches and ospell images, which are in
+// native byte order
+void put_u32(std::string & blob, uint32_t number);
+void put_weight(std::string & blob, Weight weight);
+void put_string(std::string & blob, const std::string & s);
+// append @a length bytes of @a data, starting at the next multiple of
+// COLUMN_ALIGNMENT from the start of @a blob
+void put_column(std::string & blob, const void * data, size_t length);
+// read back what put_u32() and put_weight() wrote, or return false if
+// it doesn't fit before @a end
+bool get_u32(const char ** raw, const char * end, uint32_t & number);
+bool get_weight(const char ** raw, const char * end, Weight & weight);
+
+//! Internal class for memory-mapped ospell data.
+
+//! Maps a file read-only into memory. Ospell images are searched in
+//! place in one, so processes mapping the same image share one copy of
+//! its tables; suggestion stores and saved caches are read through one.
+class MappedFile
+{
+private:
+    char * data; //!< start of the mapping
+    size_t data_length; //!< length of the mapping
+
+public:
+    //!
+    //! @brief map all of @a filename, which must not be empty.
+    MappedFile(const std::string & filename);
+    //!
+    //! @brief map the first @a length bytes of the file open as @a fd,
+    //!        which stays open and the caller's to close.
+    MappedFile(int fd, size_t length);
+    ~MappedFile(void);
+    //!
+    //! start of the mapped data
+    char * get_data(void) const;
+    //!
+    //! length of the mapped data in bytes
+    size_t size(void) const;
+};
+
+//! Internal class for reading ospell images.
+
+//! Reads the fields of an ospell image in memory one after another,
+//! throwing ImageReadingException at the first one that would run past
+//! the end. Columns are returned in place, so the image has to outlive
+//! what is read from it.
+class ImageReader
+{
+private:
+    char * base; //!< start of the image
+    char * position; //!< next field
+    char * end; //!< end of the image
+
+public:
+    //!
+    //! read the image of @a length bytes at @a data
+    ImageReader(char * data, size_t length);
+    uint32_t read_u32(void);
+    Weight read_weight(void);
+    std::string read_string(void);
+    //!
+    //! the next @a length bytes
+    char * read_bytes(size_t length);
+    //!
+    //! the @a length bytes of the next column, skipping its padding
+    char * read_column(size_t length);
+};
+
 //! Internal class for Transducer processing.
 
 //! Contains low-level processing stuff.
@@ -107,9 +177,9 @@ private:
     bool has_input_epsilon_cycles;
     bool has_unweighted_input_epsilon_cycles;
     void read_property(bool &property, FILE * f);
-    void read_property(bool &property, char ** raw);
+    void read_property(bool &property, char ** raw, const char * raw_end);
     void skip_hfst3_header(FILE * f);
-    void skip_hfst3_header(char ** f);
+    void skip_hfst3_header(char ** f, const char * raw_end);
 
 public:
     //!
@@ -117,8 +187,15 @@ public:
     TransducerHeader(FILE * f);
 
     //!
-    //! read header from raw memory data @a raw
-    TransducerHeader(char ** raw);
+    //! read header from raw memory data @a raw, checking it against
+    //! @a raw_end unless that is NULL
+    TransducerHeader(char ** raw, const char * raw_end = NULL);
+    //!
+    //! read header from ospell @a image
+    TransducerHeader(ImageReader & image);
+    //!
+    //! append header to ospell image @a blob
+    void write(std::string & blob) const;
     //!
     //! count symbols
     SymbolNumber symbol_count(void);
@@ -142,9 +219,9 @@ public:
 class FlagDiacriticOperation
 {
 private:
-    const FlagDiacriticOperator operation;
-    const SymbolNumber feature;
-    const ValueNumber value;
+    FlagDiacriticOperator operation;
+    SymbolNumber feature;
+    ValueNumber value;
 public:
     //!
     //! Construct flag diacritic of from \@ @a op . @a feat . @a val \@.
@@ -172,6 +249,85 @@ public:
 
 };
 
+//! Internal class for flag diacritic processing.
+
+//! The set of flag diacritic symbols of an alphabet, a bit per symbol.
+//! Also keeps the range the flags fall in, so that a vector scan can
+//! rule out most other symbols without looking at the bits.
+class FlagSymbolSet
+{
+private:
+    std::vector<uint32_t> bits;
+    SymbolNumber lowest;
+    SymbolNumber highest;
+    size_t count;
+
+public:
+    FlagSymbolSet(void):
+        lowest(0), highest(0), count(0) {}
+    //!
+    //! add flag diacritic @a symbol
+    void insert(SymbolNumber symbol);
+    //!
+    //! whether @a symbol is a flag diacritic
+    bool contains(SymbolNumber symbol) const
+    {
+        size_t word = symbol >> 5;
+        return word < bits.size() && ((bits[word] >> (symbol & 31)) & 1);
+    }
+    //!
+    //! smallest flag symbol, or 0 if there are none
+    SymbolNumber get_lowest(void) const { return lowest; }
+    //!
+    //! how far the largest flag symbol is from the smallest one
+    SymbolNumber get_span(void) const
+    {
+        return static_cast<SymbolNumber>(highest - lowest);
+    }
+    //!
+    //! whether every symbol in the range is a flag
+    bool is_contiguous(void) const
+    {
+        return count == static_cast<size_t>(highest - lowest) + 1;
+    }
+};
+
+//! Internal class for flag diacritic processing.
+
+//! The flag diacritic operations of an alphabet in an array indexed by
+//! symbol number, built when the alphabet is read and only read after
+//! that, so that telling a flag apart and finding its operation are an
+//! indexed load each.
+class OperationTable
+{
+private:
+    std::vector<FlagDiacriticOperation> by_symbol;
+    FlagSymbolSet flag_symbols;
+
+public:
+    //!
+    //! make @a symbol the flag diacritic @a op
+    void insert(SymbolNumber symbol, const FlagDiacriticOperation & op);
+    //!
+    //! whether @a symbol is a flag diacritic
+    bool is_flag(SymbolNumber symbol) const
+    {
+        return flag_symbols.contains(symbol);
+    }
+    //!
+    //! the operation of flag diacritic @a symbol, or NULL if it isn't one
+    const FlagDiacriticOperation * find(SymbolNumber symbol) const
+    {
+        return is_flag(symbol) ? &by_symbol[symbol] : NULL;
+    }
+    //!
+    //! the set of flag diacritic symbols
+    const FlagSymbolSet & get_flag_symbols(void) const
+    {
+        return flag_symbols;
+    }
+};
+
 //! Internal class for alphabet processing.
 
 //! Contains low-level processing stuff.
@@ -179,7 +335,7 @@ class TransducerAlphabet
 {
 private:
     KeyTable kt;
-    OperationMap operations;
+    OperationTable operations;
     SymbolNumber unknown_symbol;
     SymbolNumber identity_symbol;
     SymbolNumber flag_state_size;
@@ -188,15 +344,24 @@ private:
     void process_symbol(char * line);
 
     void read(FILE * f, SymbolNumber number_of_symbols);
-    void read(char ** raw, SymbolNumber number_of_symbols);
+    void read(char ** raw, const char * raw_end,
+              SymbolNumber number_of_symbols);
 
 public:
     //!
     //! read alphabets from file @a f
     TransducerAlphabet(FILE *f, SymbolNumber number_of_symbols);
     //!
-    //! read alphabes from raw data @a raw
-    TransducerAlphabet(char ** raw, SymbolNumber number_of_symbols);
+    //! read alphabes from raw data @a raw, checking it against
+    //! @a raw_end unless that is NULL
+    TransducerAlphabet(char ** raw, SymbolNumber number_of_symbols,
+                       const char * raw_end = NULL);
+    //!
+    //! read alphabet from ospell @a image
+    TransducerAlphabet(ImageReader & image);
+    //!
+    //! append alphabet to ospell image @a blob
+    void write(std::string & blob) const;
 
     void add_symbol(std::string & sym);
     void add_symbol(char * sym);
@@ -204,8 +369,11 @@ public:
     //! get alphabet's keytable mapping
     KeyTable * get_key_table(void);
     //!
-    //! get flag operation map stuff
-    OperationMap * get_operation_map(void);
+    //! get flag operations by symbol
+    const OperationTable * get_operation_table(void) const;
+    //!
+    //! get the set of flag diacritic symbols
+    const FlagSymbolSet & get_flag_symbols(void) const;
     //!
     //! get state's size
     SymbolNumber get_state_size(void);
@@ -221,7 +389,7 @@ public:
     bool has_string(std::string const & s) const;
     //!
     //! get if given symbol is a flag
-    bool is_flag(SymbolNumber symbol);
+    bool is_flag(SymbolNumber symbol) const;
 };
 
 class LetterTrie;
@@ -366,17 +534,24 @@ public:
 
 //! Internal class for Transducer processing.
 
-//! Contains low-level processing stuff.
+//! The table is kept as a column per field, the input symbols in one
+//! array and the targets in another, converted from the records of the
+//! file when it's read.
 class IndexTable
 {
 private:
-    char * indices;
+    char * storage; //!< allocation holding the columns, or NULL
+    SymbolNumber * input_symbols; //!< input symbol of each index
+    TransitionTableIndex * targets; //!< target or final weight of each index
     TransitionTableIndex size;
+    void allocate(TransitionTableIndex number_of_table_entries);
+    void convert(const char * records);
     void read(FILE * f,
               TransitionTableIndex number_of_table_entries);
     void read(char ** raw,
               TransitionTableIndex number_of_table_entries);
-    void convert_to_big_endian(void);
+    void read(char ** raw, const char * raw_end,
+              TransitionTableIndex number_of_table_entries);
 
 public:
     //!
@@ -387,32 +562,69 @@ public:
     //! read index table from raw data @a raw.
     IndexTable(char ** raw,
                TransitionTableIndex number_of_table_entries);
+    //!
+    //! read index table from mapped data @a raw ending at @a raw_end.
+    IndexTable(char ** raw, const char * raw_end,
+               TransitionTableIndex number_of_table_entries);
+    //!
+    //! use index table columns of ospell @a image in place, or copies
+    //! of them if they aren't aligned in memory
+    IndexTable(ImageReader & image);
     ~IndexTable(void);
     //!
+    //! append index table columns to ospell image @a blob
+    void write(std::string & blob) const;
+    //!
     //! input symbol for the index
-    SymbolNumber input_symbol(TransitionTableIndex i) const;
+    SymbolNumber input_symbol(TransitionTableIndex i) const
+    {
+        return (i < size) ? input_symbols[i] : NO_SYMBOL;
+    }
     //!
     //! target state location for the index
-    TransitionTableIndex target(TransitionTableIndex i) const;
+    TransitionTableIndex target(TransitionTableIndex i) const
+    {
+        return (i < size) ? targets[i] : NO_TABLE_INDEX;
+    }
     //!
     //! whether it's final transition
-    bool final(TransitionTableIndex i) const;
+    bool final(TransitionTableIndex i) const
+    {
+        return input_symbol(i) == NO_SYMBOL && target(i) != NO_TABLE_INDEX;
+    }
     //!
     //! transition's weight
-    Weight final_weight(TransitionTableIndex i) const;
+    Weight final_weight(TransitionTableIndex i) const
+    {
+        if (i < size) {
+            Weight w;
+            memcpy(&w, targets + i, sizeof(w));
+            return w;
+        } else {
+            return INFINITE_WEIGHT;
+        }
+    }
 };
 
 //! Internal class for transition processing.
 
-//! Contains low-level processing stuff.
+//! Like the index table, the transitions are kept as a column per field,
+//! each column aligned to a cache line and the input symbols padded at
+//! the end with NO_SYMBOL, so that runs of transitions can be scanned
+//! a vector at a time.
 class TransitionTable
 {
 protected:
-    //!
-    //! raw transition data
-    char * transitions;
+    char * storage; //!< allocation holding the columns, or NULL
+    SymbolNumber * input_symbols; //!< input symbol of each transition
+    SymbolNumber * output_symbols; //!< output symbol of each transition
+    TransitionTableIndex * targets; //!< target of each transition
+    Weight * weights; //!< weight of each transition
     TransitionTableIndex size;
 
+    void allocate(TransitionTableIndex number_of_table_entries);
+    //! fill the columns from the little-endian file records in @a records
+    void convert(const char * records);
     //!
     //! read known amount of transitions from file @a f
     void read(FILE * f,
@@ -420,8 +632,15 @@ protected:
     //! read known amount of transitions from raw dara @a data
     void read(char ** raw,
               TransitionTableIndex number_of_table_entries);
-    void convert_to_big_endian(void);
+    //! read known amount of transitions from mapped data @a raw, checking
+    //! that they end by @a raw_end
+    void read(char ** raw, const char * raw_end,
+              TransitionTableIndex number_of_table_entries);
 public:
+    //!
+    //! Transitions past the end of the input symbol column that are
+    //! readable and hold NO_SYMBOL.
+    static const size_t PADDING = 32;
     //!
     //! read transition table from file @a f
     TransitionTable(FILE * f,
@@ -430,25 +649,69 @@ public:
     //! read transition table from raw data @a raw
     TransitionTable(char ** raw,
                     TransitionTableIndex transition_count);
+    //!
+    //! read transition table from mapped data @a raw ending at @a raw_end
+    TransitionTable(char ** raw, const char * raw_end,
+                    TransitionTableIndex transition_count);
+    //!
+    //! use transition table columns of ospell @a image in place, or
+    //! copies of them if they aren't aligned in memory
+    TransitionTable(ImageReader & image);
 
     ~TransitionTable(void);
     //!
+    //! append transition table columns to ospell image @a blob
+    void write(std::string & blob) const;
+    //!
     //! transition's input symbol
-    SymbolNumber input_symbol(TransitionTableIndex i) const;
+    SymbolNumber input_symbol(TransitionTableIndex i) const
+    {
+        return (i < size) ? input_symbols[i] : NO_SYMBOL;
+    }
     //!
     //! transition's output symbol
-    SymbolNumber output_symbol(TransitionTableIndex i) const;
+    SymbolNumber output_symbol(TransitionTableIndex i) const
+    {
+        return (i < size) ? output_symbols[i] : NO_SYMBOL;
+    }
     //!
     //! target node location
-    TransitionTableIndex target(TransitionTableIndex i) const;
+    TransitionTableIndex target(TransitionTableIndex i) const
+    {
+        return (i < size) ? targets[i] : NO_TABLE_INDEX;
+    }
     //!
     //! weight of transiton
-    Weight weight(TransitionTableIndex i) const;
+    Weight weight(TransitionTableIndex i) const
+    {
+        return (i < size) ? weights[i] : INFINITE_WEIGHT;
+    }
     //!
     //! whether it's final
-    bool final(TransitionTableIndex i) const;
-
-
+    bool final(TransitionTableIndex i) const
+    {
+        return input_symbol(i) == NO_SYMBOL &&
+            output_symbol(i) == NO_SYMBOL &&
+            target(i) == 1;
+    }
+    //!
+    //! number of transitions
+    TransitionTableIndex get_size(void) const { return size; }
+    //!
+    //! the input symbol column, followed by PADDING times NO_SYMBOL
+    const SymbolNumber * input_symbol_column(void) const
+    {
+        return input_symbols;
+    }
+    //!
+    //! first transition from @a i on whose input isn't @a symbol
+    TransitionTableIndex run_end(TransitionTableIndex i,
+                                 SymbolNumber symbol) const;
+    //!
+    //! first transition from @a i on whose input is neither epsilon nor
+    //! a flag diacritic in @a flags
+    TransitionTableIndex epsilon_run_end(TransitionTableIndex i,
+                                         const FlagSymbolSet & flags) const;
 };
 
 template <class printable>
@@ -0,0 +1,34 @@
+"""Convert a speller to an ospell image that loads without parsing.
+
+Usage:
+
+    python -m py_hfst_ospell.make_image ARCHIVE IMAGE
+    python -m py_hfst_ospell.make_image LEXICON ERRMODEL IMAGE
+
+ARCHIVE is a zhfst archive, LEXICON and ERRMODEL are the automata of one.
+IMAGE holds them as the speller searches them, so Speller(IMAGE) only maps
+the file. It is for machines of the same byte order as the one making it,
+and has to be made again when the automata or this library change.
+"""
+import argparse
+
+from py_hfst_ospell import Speller
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Convert a speller to an ospell image.')
+    parser.add_argument('sources', nargs='+',
+                        help='zhfst archive, or lexicon and error model')
+    parser.add_argument('image', help='ospell image to write')
+    args = parser.parse_args()
+
+    if len(args.sources) > 2:
+        parser.error('give an archive, or a lexicon and an error model')
+    speller = Speller(*args.sources)
+    speller.save_image(args.image)
+    print('%s written' % args.image)
+
+
+if __name__ == '__main__':
+    main()
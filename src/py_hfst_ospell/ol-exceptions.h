@@ -82,5 +82,11 @@ HFSTOSPELL_EXCEPTION_CHILD_DECLARATION(TransitionTableReadingException);
 HFSTOSPELL_EXCEPTION_CHILD_DECLARATION(UnweightedSpellerException);
 
 HFSTOSPELL_EXCEPTION_CHILD_DECLARATION(TransducerTypeException);
+
+HFSTOSPELL_EXCEPTION_CHILD_DECLARATION(FileMappingException);
+
+HFSTOSPELL_EXCEPTION_CHILD_DECLARATION(SuggestionStoreException);
+
+HFSTOSPELL_EXCEPTION_CHILD_DECLARATION(ImageReadingException);
 } // namespace
 #endif // _OL_EXCEPTIONS_H
\ No newline at end of file
@@ -16,6 +16,10 @@
 #  include <config.h>
 #endif
 
+#include <cstring>
+#include <exception>
+#include <thread>
+
 #include "ospell.h"
 
 namespace hfst_ospell {
@@ -37,36 +41,74 @@ int nByte_utf8(unsigned char c)
     }
 }
 
+WeightQueue::WeightQueue(void):
+    capacity(0),
+    lowest(std::numeric_limits<Weight>::max())
+    {}
+
+void WeightQueue::reset(size_t new_capacity)
+{
+    heap.clear();
+    capacity = new_capacity;
+    heap.reserve(capacity);
+    lowest = std::numeric_limits<Weight>::max();
+}
+
 void WeightQueue::push(Weight w)
 {
-    for (WeightQueue::iterator it = begin(); it != end(); ++it) {
-        if (*it > w) {
-            insert(it, w);
+    if (capacity > 0 && heap.size() >= capacity) {
+        if (w >= heap.front()) {
             return;
         }
+        // w takes the place of the biggest weight
+        std::pop_heap(heap.begin(), heap.end());
+        heap.back() = w;
+    } else {
+        heap.push_back(w);
     }
-    push_back(w);
+    std::push_heap(heap.begin(), heap.end());
+    lowest = std::min(lowest, w);
+}
+
+void WeightQueue::replace(Weight old_weight, Weight w)
+{
+    auto found = std::find(heap.begin(), heap.end(), old_weight);
+    if (found == heap.end()) {
+        // dropped already for being too big
+        push(w);
+        return;
+    }
+    *found = w;
+    std::make_heap(heap.begin(), heap.end());
+    lowest = std::min(lowest, w);
 }
 
 void WeightQueue::pop(void)
 {
-    pop_back();
+    std::pop_heap(heap.begin(), heap.end());
+    heap.pop_back();
+    // only the last weight can have been the lowest one
+    if (heap.size() == 0) {
+        lowest = std::numeric_limits<Weight>::max();
+    }
+}
+
+size_t WeightQueue::size(void) const
+{
+    return heap.size();
 }
 
 Weight WeightQueue::get_lowest(void) const
 {
-    if (size() == 0) {
-        return std::numeric_limits<Weight>::max();
-    }
-    return front();
+    return lowest;
 }
 
 Weight WeightQueue::get_highest(void) const
 {
-    if (size() == 0) {
+    if (heap.size() == 0) {
         return std::numeric_limits<Weight>::max();
     }
-    return back();
+    return heap.front();
 }
 
 Transducer::Transducer(FILE* f):
@@ -87,15 +129,203 @@ Transducer::Transducer(char* raw):
     transitions(&raw,header.target_table_size())
     {}
 
-TreeNode TreeNode::update_lexicon(SymbolNumber symbol,
+Transducer::Transducer(char* raw, size_t length):
+    Transducer(raw, raw + length)
+    {}
+
+Transducer::Transducer(char* raw, const char* raw_end):
+    header(TransducerHeader(&raw, raw_end)),
+    alphabet(TransducerAlphabet(&raw, header.symbol_count(), raw_end)),
+    keys(alphabet.get_key_table()),
+    encoder(keys,header.input_symbol_count()),
+    indices(&raw, raw_end, header.index_table_size()),
+    transitions(&raw, raw_end, header.target_table_size())
+    {}
+
+Transducer::Transducer(ImageReader & image):
+    header(image),
+    alphabet(image),
+    keys(alphabet.get_key_table()),
+    encoder(keys,header.input_symbol_count()),
+    indices(image),
+    transitions(image)
+{
+    // symbols an error model added to the alphabet before it was written
+    for (size_t k = alphabet.get_orig_symbol_count(); k < keys->size(); ++k) {
+        encoder.read_input_symbol(keys->at(k), static_cast<int>(k));
+    }
+}
+
+void Transducer::write(std::string & blob)
+{
+    header.write(blob);
+    alphabet.write(blob);
+    indices.write(blob);
+    transitions.write(blob);
+}
+
+const size_t KnownForms::MAX_LENGTH;
+
+KnownForms::KnownForms(void):
+    slots(NULL),
+    mask(0),
+    count(0)
+{}
+
+void KnownForms::reset(size_t forms)
+{
+    // at most half full, so that probe sequences stay short
+    size_t size = 2;
+    while (size < 2 * forms) {
+        size *= 2;
+    }
+    storage.assign(size * sizeof(Slot) + 64, 0);
+    uintptr_t start = reinterpret_cast<uintptr_t>(&storage[0]);
+    slots = reinterpret_cast<Slot *>((start + 63) & ~uintptr_t(63));
+    mask = size - 1;
+    count = 0;
+}
+
+size_t KnownForms::hash(const char * form, size_t length)
+{
+    // FNV-1a
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < length; ++i) {
+        h ^= static_cast<unsigned char>(form[i]);
+        h *= 1099511628211ull;
+    }
+    return static_cast<size_t>(h ^ (h >> 32));
+}
+
+bool KnownForms::add(const char * form, size_t length, bool accepted)
+{
+    if (slots == NULL || length == 0 || length > MAX_LENGTH ||
+        2 * (count + 1) > mask + 1) {
+        return false;
+    }
+    for (size_t i = hash(form, length) & mask; ; i = (i + 1) & mask) {
+        Slot & slot = slots[i];
+        if (slot.length == 0) {
+            slot.length = static_cast<uint8_t>(length);
+            memcpy(slot.form, form, length);
+            ++count;
+        } else if (slot.length != length ||
+                   memcmp(slot.form, form, length) != 0) {
+            continue;
+        }
+        slot.verdict = static_cast<uint8_t>(accepted ? Accepted : Rejected);
+        return true;
+    }
+}
+
+KnownForms::Verdict KnownForms::find(const char * form) const
+{
+    if (count == 0) {
+        return Unknown;
+    }
+    size_t length = strnlen(form, MAX_LENGTH + 1);
+    if (length == 0 || length > MAX_LENGTH) {
+        return Unknown;
+    }
+    for (size_t i = hash(form, length) & mask; ; i = (i + 1) & mask) {
+        const Slot & slot = slots[i];
+        if (slot.length == 0) {
+            return Unknown;
+        }
+        if (slot.length == length && memcmp(slot.form, form, length) == 0) {
+            return static_cast<Verdict>(slot.verdict);
+        }
+    }
+}
+
+bool KnownForms::empty(void) const
+{
+    return count == 0;
+}
+
+void PathArena::clear(const PathArena * new_base)
+{
+    nodes.clear();
+    base = new_base;
+    base_size = (new_base == NULL) ? 0 : new_base->size();
+}
+
+PathIndex PathArena::extend(PathIndex path, SymbolNumber symbol)
+{
+    if (symbol == 0) {
+        return path;
+    }
+    PathNode node;
+    node.parent = path;
+    node.symbol = symbol;
+    nodes.push_back(node);
+    return base_size + static_cast<PathIndex>(nodes.size() - 1);
+}
+
+void PathArena::symbols(PathIndex path, SymbolVector & symbol_vector) const
+{
+    symbol_vector.clear();
+    const PathArena * arena = this;
+    while (path != EMPTY_PATH) {
+        // strings only point backwards, so once in the base we stay there
+        while (path < arena->base_size) {
+            arena = arena->base;
+        }
+        const PathNode & node = arena->nodes[path - arena->base_size];
+        symbol_vector.push_back(node.symbol);
+        path = node.parent;
+    }
+    std::reverse(symbol_vector.begin(), symbol_vector.end());
+}
+
+PathIndex PathArena::size(void) const
+{
+    return base_size + static_cast<PathIndex>(nodes.size());
+}
+
+size_t PathArena::memory_size(void) const
+{
+    return nodes.capacity() * sizeof(PathNode);
+}
+
+void PathArena::write(std::string & blob) const
+{
+    put_u32(blob, static_cast<uint32_t>(nodes.size()));
+    for (auto & node : nodes) {
+        put_u32(blob, node.parent);
+        put_u32(blob, node.symbol);
+    }
+}
+
+bool PathArena::read(const char ** raw, const char * end)
+{
+    clear();
+    uint32_t count;
+    if (!get_u32(raw, end, count) ||
+        count > static_cast<size_t>(end - *raw) / (2 * sizeof(uint32_t))) {
+        return false;
+    }
+    nodes.resize(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t symbol;
+        get_u32(raw, end, nodes[i].parent);
+        get_u32(raw, end, symbol);
+        nodes[i].symbol = static_cast<SymbolNumber>(symbol);
+        // strings only point backwards
+        if (nodes[i].parent != EMPTY_PATH && nodes[i].parent >= i) {
+            nodes.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+TreeNode TreeNode::update_lexicon(PathArena & paths,
+                                  SymbolNumber symbol,
                                   TransitionTableIndex next_lexicon,
                                   Weight weight)
 {
-    SymbolVector str(this->string);
-    if (symbol != 0) {
-        str.push_back(symbol);
-    }
-    return TreeNode(str,
+    return TreeNode(paths.extend(this->output, symbol),
                     this->input_state,
                     this->mutator_state,
                     next_lexicon,
@@ -106,7 +336,7 @@ TreeNode TreeNode::update_lexicon(SymbolNumber symbol,
 TreeNode TreeNode::update_mutator(TransitionTableIndex next_mutator,
                                   Weight weight)
 {
-    return TreeNode(this->string,
+    return TreeNode(this->output,
                     this->input_state,
                     next_mutator,
                     this->lexicon_state,
@@ -114,17 +344,14 @@ TreeNode TreeNode::update_mutator(TransitionTableIndex next_mutator,
                     this->weight + weight);
 }
 
-TreeNode TreeNode::update(SymbolNumber symbol,
+TreeNode TreeNode::update(PathArena & paths,
+                          SymbolNumber symbol,
                           unsigned int next_input,
                           TransitionTableIndex next_mutator,
                           TransitionTableIndex next_lexicon,
                           Weight weight)
 {
-    SymbolVector str(this->string);
-    if (symbol != 0) {
-        str.push_back(symbol);
-    }
-    return TreeNode(str,
+    return TreeNode(paths.extend(this->output, symbol),
                     next_input,
                     next_mutator,
                     next_lexicon,
@@ -132,16 +359,13 @@ TreeNode TreeNode::update(SymbolNumber symbol,
                     this->weight + weight);
 }
 
-TreeNode TreeNode::update(SymbolNumber symbol,
+TreeNode TreeNode::update(PathArena & paths,
+                          SymbolNumber symbol,
                           TransitionTableIndex next_mutator,
                           TransitionTableIndex next_lexicon,
                           Weight weight)
 {
-    SymbolVector str(this->string);
-    if (symbol != 0) {
-        str.push_back(symbol);
-    }
-    return TreeNode(str,
+    return TreeNode(paths.extend(this->output, symbol),
                     this->input_state,
                     next_mutator,
                     next_lexicon,
@@ -149,7 +373,8 @@ TreeNode TreeNode::update(SymbolNumber symbol,
                     this->weight + weight);
 }
 
-bool TreeNode::try_compatible_with(FlagDiacriticOperation op)
+bool apply_flag_operation(FlagDiacriticState & flag_state,
+                          const FlagDiacriticOperation & op)
 {
     switch (op.Operation()) {
 
@@ -194,69 +419,604 @@ bool TreeNode::try_compatible_with(FlagDiacriticOperation op)
     return false; // to make the compiler happy
 }
 
+FlagStatePool::FlagStatePool(void):
+    state_size(0),
+    operations(NULL),
+    base(NULL),
+    base_size(0)
+    {}
+
+FlagStatePool::FlagStatePool(SymbolNumber size,
+                             const OperationTable * operation_table):
+    state_size(size),
+    operations(operation_table),
+    scratch(size, 0),
+    base(NULL),
+    base_size(0)
+{
+    intern(scratch); // the neutral state gets handle 0
+}
+
+void FlagStatePool::clear(const FlagStatePool * new_base)
+{
+    values.clear();
+    handles.clear();
+    results.clear();
+    base = new_base;
+    base_size = (new_base == NULL) ?
+        0 : static_cast<FlagStateHandle>(new_base->size());
+    if (base == NULL) {
+        scratch.assign(state_size, 0);
+        intern(scratch);
+    }
+}
+
+FlagStateHandle FlagStatePool::intern(const FlagDiacriticState & state)
+{
+    std::string key(reinterpret_cast<const char *>(state.data()),
+                    state_size * sizeof(ValueNumber));
+    if (base != NULL) {
+        auto found = base->handles.find(key);
+        if (found != base->handles.end()) {
+            return found->second;
+        }
+    }
+    auto found = handles.find(key);
+    if (found != handles.end()) {
+        return found->second;
+    }
+    FlagStateHandle handle =
+        base_size + static_cast<FlagStateHandle>(handles.size());
+    handles[key] = handle;
+    values.insert(values.end(), state.begin(), state.end());
+    return handle;
+}
+
+FlagStateHandle FlagStatePool::apply(FlagStateHandle state,
+                                     SymbolNumber flag_symbol)
+{
+    uint64_t key = (static_cast<uint64_t>(state) << 16) | flag_symbol;
+    if (state < base_size) {
+        auto found = base->results.find(key);
+        if (found != base->results.end()) {
+            return found->second;
+        }
+    }
+    auto found = results.find(key);
+    if (found != results.end()) {
+        return found->second;
+    }
+    FlagStateHandle result = NO_FLAG_STATE;
+    const FlagDiacriticOperation * op = operations->find(flag_symbol);
+    if (op != NULL) {
+        const std::vector<ValueNumber> & state_values =
+            (state < base_size) ? base->values : values;
+        size_t first = (state < base_size) ?
+            state * state_size : (state - base_size) * state_size;
+        scratch.assign(state_values.begin() + first,
+                       state_values.begin() + first + state_size);
+        if (apply_flag_operation(scratch, *op)) {
+            result = intern(scratch);
+        }
+    }
+    results[key] = result;
+    return result;
+}
+
+size_t FlagStatePool::size(void) const
+{
+    return base_size + handles.size();
+}
+
+size_t FlagStatePool::memory_size(void) const
+{
+    // hash map nodes take about a key, a value and two pointers
+    return values.capacity() * sizeof(ValueNumber) +
+        handles.size() * (sizeof(std::string) + state_size * sizeof(ValueNumber) +
+                          sizeof(FlagStateHandle) + 2 * sizeof(void *)) +
+        results.size() * (sizeof(uint64_t) + sizeof(FlagStateHandle) +
+                          2 * sizeof(void *));
+}
+
+void FlagStatePool::write(std::string & blob) const
+{
+    put_u32(blob, state_size);
+    put_u32(blob, static_cast<uint32_t>(handles.size()));
+    blob.append(reinterpret_cast<const char *>(values.data()),
+                values.size() * sizeof(ValueNumber));
+}
+
+bool FlagStatePool::read(const char ** raw, const char * end)
+{
+    clear();
+    uint32_t size;
+    uint32_t count;
+    if (!get_u32(raw, end, size) || size != state_size ||
+        !get_u32(raw, end, count) || count == 0 ||
+        count > static_cast<size_t>(end - *raw) /
+            (state_size * sizeof(ValueNumber) + 1)) {
+        return false;
+    }
+    // interning them in order gives each state its old handle
+    for (uint32_t i = 0; i < count; ++i) {
+        if (state_size > 0) {
+            memcpy(scratch.data(), *raw, state_size * sizeof(ValueNumber));
+            *raw += state_size * sizeof(ValueNumber);
+        }
+        if (intern(scratch) != i) {
+            clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+void PrefixCache::set_budget(size_t new_budget)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    budget = new_budget;
+    trim();
+}
+
+bool PrefixCache::enabled(void) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return budget != 0;
+}
+
+std::shared_ptr<const CacheContainer>
+PrefixCache::find(const std::string & prefix)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = index.find(prefix);
+    if (found == index.end()) {
+        return std::shared_ptr<const CacheContainer>();
+    }
+    entries.splice(entries.begin(), entries, found->second);
+    return found->second->second;
+}
+
+void PrefixCache::insert(const std::string & prefix,
+                         const std::shared_ptr<const CacheContainer> & entry)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (entry->bytes > budget || index.count(prefix) > 0) {
+        // too big to keep, or another search got there first
+        return;
+    }
+    entries.push_front(std::make_pair(prefix, entry));
+    index[prefix] = entries.begin();
+    bytes += entry->bytes;
+    trim();
+}
+
+void PrefixCache::trim(void)
+{
+    while (bytes > budget && !entries.empty()) {
+        bytes -= entries.back().second->bytes;
+        index.erase(entries.back().first);
+        entries.pop_back();
+    }
+}
+
+void PrefixCache::clear(void)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    index.clear();
+    bytes = 0;
+}
+
+size_t PrefixCache::memory_size(void) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return bytes;
+}
+
+bool TreeNode::try_compatible_with(FlagStatePool & flags,
+                                   SymbolNumber flag_symbol)
+{
+    FlagStateHandle result = flags.apply(flag_state, flag_symbol);
+    if (result == NO_FLAG_STATE) {
+        return false;
+    }
+    flag_state = result;
+    return true;
+}
+
 Speller::Speller(Transducer* mutator_ptr, Transducer* lexicon_ptr):
         mutator(mutator_ptr),
         lexicon(lexicon_ptr),
-        input(),
-        queue(TreeNodeQueue()),
-        next_node(FlagDiacriticState(get_state_size(), 0)),
-        limit(std::numeric_limits<Weight>::max()),
         alphabet_translator(SymbolVector()),
         operations(lexicon->get_operations()),
-        limiting(None),
-        mode(Correct),
-        max_time(-1.0),
-        start_clock(0),
-        call_counter(0),
-        limit_reached(false)
+        cache(mutator_ptr == NULL ? 0 : mutator_ptr->get_key_table()->size()),
+        cache_built(cache.size()),
+        prefix_depth(1)
             {
                 if (mutator != NULL) {
                     build_alphabet_translator();
-                    cache = std::vector<CacheContainer>(
-                        mutator->get_key_table()->size(), CacheContainer());
+                    remaining_costs.build(*mutator);
                 }
             }
 
+Speller::Speller(Transducer* mutator_ptr, Transducer* lexicon_ptr,
+                 ImageReader & image):
+        mutator(mutator_ptr),
+        lexicon(lexicon_ptr),
+        alphabet_translator(SymbolVector()),
+        operations(lexicon->get_operations()),
+        cache(mutator_ptr == NULL ? 0 : mutator_ptr->get_key_table()->size()),
+        cache_built(cache.size()),
+        prefix_depth(1)
+            {
+                if (mutator != NULL) {
+                    uint32_t count = image.read_u32();
+                    if (count != mutator->get_key_table()->size()) {
+                        HFSTOSPELL_THROW(ImageReadingException);
+                    }
+                    for (uint32_t i = 0; i < count; ++i) {
+                        uint32_t symbol = image.read_u32();
+                        if (symbol >= lexicon->get_key_table()->size()) {
+                            HFSTOSPELL_THROW(ImageReadingException);
+                        }
+                        alphabet_translator.push_back(
+                            static_cast<SymbolNumber>(symbol));
+                    }
+                    remaining_costs.read(image);
+                }
+            }
+
+void Speller::write_image(std::string & blob) const
+{
+    if (mutator == NULL) {
+        return;
+    }
+    put_u32(blob, static_cast<uint32_t>(alphabet_translator.size()));
+    for (auto symbol : alphabet_translator) {
+        put_u32(blob, symbol);
+    }
+    remaining_costs.write(blob);
+}
+
+Speller::~Speller(void)
+{
+    for (auto context : idle_contexts) {
+        delete context;
+    }
+}
+
 
 SymbolNumber
 Speller::get_state_size()
 {
-    return static_cast<SymbolNumber>(lexicon->get_state_size());
+    return static_cast<SymbolNumber>(lexicon->get_state_size());
+}
+
+SearchContext* Speller::acquire_context(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(contexts_mutex);
+        if (idle_contexts.size() > 0) {
+            SearchContext * context = idle_contexts.back();
+            idle_contexts.pop_back();
+            return context;
+        }
+    }
+    return new SearchContext(this);
+}
+
+void Speller::release_context(SearchContext * context)
+{
+    // let go of the prefix cache entry, in case it's dropped
+    context->prefix_entry.reset();
+    std::lock_guard<std::mutex> lock(contexts_mutex);
+    idle_contexts.push_back(context);
+}
+
+bool Speller::check(char * line)
+{
+    // no need for a context when the answer is known
+    std::shared_ptr<const KnownForms> known = std::atomic_load(&known_forms);
+    if (known) {
+        KnownForms::Verdict verdict = known->find(line);
+        if (verdict != KnownForms::Unknown) {
+            return verdict == KnownForms::Accepted;
+        }
+    }
+    SearchContext * context = acquire_context();
+    bool rv = context->accepts(line);
+    release_context(context);
+    return rv;
+}
+
+size_t Speller::set_known_forms(const std::vector<std::string> & forms)
+{
+    // filled aside and put in place whole, so checks running meanwhile
+    // see either the old table or the new one
+    std::shared_ptr<KnownForms> fresh = std::make_shared<KnownForms>();
+    fresh->reset(forms.size());
+    SearchContext * context = acquire_context();
+    std::vector<char> buffer;
+    size_t kept = 0;
+    for (auto & form : forms) {
+        if (form.size() == 0 || form.size() > KnownForms::MAX_LENGTH) {
+            continue;
+        }
+        buffer.assign(form.begin(), form.end());
+        buffer.push_back('\0');
+        if (fresh->add(form.data(), form.size(),
+                       context->accepts(&buffer[0]))) {
+            ++kept;
+        }
+    }
+    release_context(context);
+    std::atomic_store(&known_forms,
+                      std::shared_ptr<const KnownForms>(fresh));
+    return kept;
+}
+
+CacheContainer & Speller::get_cache(SymbolNumber first_sym)
+{
+    // shared by all contexts, whichever gets here first builds it
+    std::call_once(cache_built[first_sym], [this, first_sym]() {
+            SearchContext * context = acquire_context();
+            char empty[] = "";
+            context->mode = SearchContext::Correct;
+            context->init_input(empty);
+            if (first_sym != 0) {
+                context->input.push_back(first_sym);
+            }
+            context->build_cache(first_sym, cache[first_sym]);
+            release_context(context);
+        });
+    return cache[first_sym];
+}
+
+void Speller::build_all_caches(const std::atomic<bool> * stop)
+{
+    for (size_t i = 0; i < cache.size(); ++i) {
+        if (stop != NULL && stop->load()) {
+            return;
+        }
+        get_cache(static_cast<SymbolNumber>(i));
+    }
+}
+
+// Cache blobs start with these, the number of entries, and the sizes of
+// the alphabets they were built with
+static const char CACHE_MAGIC[8] = { 'O', 'S', 'P', 'E', 'L', 'L', 'C', 'C' };
+static const uint32_t CACHE_VERSION = 1;
+
+static void write_results(std::string & blob,
+                          const StringWeightVector & results)
+{
+    put_u32(blob, static_cast<uint32_t>(results.size()));
+    for (auto & result : results) {
+        put_u32(blob, static_cast<uint32_t>(result.first.size()));
+        blob.append(result.first);
+        put_weight(blob, result.second);
+    }
+}
+
+static bool read_results(const char ** raw, const char * end,
+                         StringWeightVector & results)
+{
+    uint32_t count;
+    if (!get_u32(raw, end, count)) {
+        return false;
+    }
+    results.clear();
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t length;
+        Weight weight;
+        if (!get_u32(raw, end, length) ||
+            length > static_cast<size_t>(end - *raw)) {
+            return false;
+        }
+        std::string result(*raw, length);
+        *raw += length;
+        if (!get_weight(raw, end, weight)) {
+            return false;
+        }
+        results.push_back(StringWeightPair(result, weight));
+    }
+    return true;
+}
+
+void Speller::write_cache(std::string & blob)
+{
+    blob.append(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    put_u32(blob, CACHE_VERSION);
+    put_u32(blob, static_cast<uint32_t>(cache.size()));
+    put_u32(blob, static_cast<uint32_t>(lexicon->get_key_table()->size()));
+    put_u32(blob, get_state_size());
+    for (size_t i = 0; i < cache.size(); ++i) {
+        const CacheContainer & entry = get_cache(static_cast<SymbolNumber>(i));
+        put_u32(blob, static_cast<uint32_t>(entry.nodes.size()));
+        for (auto & node : entry.nodes) {
+            put_u32(blob, node.output);
+            put_u32(blob, node.input_state);
+            put_u32(blob, node.mutator_state);
+            put_u32(blob, node.lexicon_state);
+            put_u32(blob, node.flag_state);
+            put_weight(blob, node.weight);
+        }
+        entry.paths.write(blob);
+        entry.flag_states.write(blob);
+        write_results(blob, entry.results_len_0);
+        write_results(blob, entry.results_len_1);
+    }
+}
+
+bool Speller::read_cache(const char * data, size_t length)
+{
+    const char * raw = data;
+    const char * end = data + length;
+    uint32_t version;
+    uint32_t entries;
+    uint32_t lexicon_symbols;
+    uint32_t state_size;
+    if (length < sizeof(CACHE_MAGIC) ||
+        memcmp(raw, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0) {
+        return false;
+    }
+    raw += sizeof(CACHE_MAGIC);
+    if (!get_u32(&raw, end, version) || version != CACHE_VERSION ||
+        !get_u32(&raw, end, entries) || entries != cache.size() ||
+        !get_u32(&raw, end, lexicon_symbols) ||
+        lexicon_symbols != lexicon->get_key_table()->size() ||
+        !get_u32(&raw, end, state_size) || state_size != get_state_size()) {
+        return false;
+    }
+    // read everything before taking anything, in case the blob is bad
+    std::vector<CacheContainer> read(entries);
+    for (auto & entry : read) {
+        uint32_t count;
+        if (!get_u32(&raw, end, count) ||
+            count > static_cast<size_t>(end - raw) / (6 * sizeof(uint32_t))) {
+            return false;
+        }
+        for (uint32_t i = 0; i < count; ++i) {
+            uint32_t fields[5];
+            Weight weight;
+            for (auto & field : fields) {
+                get_u32(&raw, end, field);
+            }
+            get_weight(&raw, end, weight);
+            entry.nodes.push_back(TreeNode(fields[0], fields[1], fields[2],
+                                           fields[3], fields[4], weight));
+        }
+        entry.flag_states = FlagStatePool(get_state_size(), operations);
+        if (!entry.paths.read(&raw, end) ||
+            !entry.flag_states.read(&raw, end) ||
+            !read_results(&raw, end, entry.results_len_0) ||
+            !read_results(&raw, end, entry.results_len_1)) {
+            return false;
+        }
+        for (auto & node : entry.nodes) {
+            if ((node.output != EMPTY_PATH &&
+                 node.output >= entry.paths.size()) ||
+                node.flag_state >= entry.flag_states.size() ||
+                node.mutator_state == NO_TABLE_INDEX ||
+                node.lexicon_state == NO_TABLE_INDEX) {
+                return false;
+            }
+        }
+        entry.empty = false;
+    }
+    if (raw != end) {
+        return false;
+    }
+    for (size_t i = 0; i < cache.size(); ++i) {
+        // entries built meanwhile stay as they are
+        std::call_once(cache_built[i], [this, &read, i]() {
+                std::swap(cache[i], read[i]);
+            });
+    }
+    return true;
+}
+
+void Speller::set_prefix_cache(unsigned int depth, size_t budget)
+{
+    prefix_depth = (depth == 0) ? 1 : depth;
+    prefix_cache.clear();
+    prefix_cache.set_budget(budget);
+}
+
+CorrectionQueue Speller::correct(char * line, int nbest,
+                                 Weight maxweight, Weight beam,
+                                 float time_cutoff)
+{
+    SearchContext * context = acquire_context();
+    context->search_order = SearchContext::DepthFirst;
+    context->parallel_threads = 1;
+    CorrectionQueue rv = context->correct(line, nbest, maxweight, beam,
+                                          time_cutoff);
+    release_context(context);
+    return rv;
+}
+
+AnalysisQueue Speller::analyse(char * line, int nbest)
+{
+    SearchContext * context = acquire_context();
+    AnalysisQueue rv = context->analyse(line, nbest);
+    release_context(context);
+    return rv;
+}
+
+AnalysisSymbolsQueue Speller::analyseSymbols(char * line, int nbest)
+{
+    SearchContext * context = acquire_context();
+    AnalysisSymbolsQueue rv = context->analyseSymbols(line, nbest);
+    release_context(context);
+    return rv;
 }
 
+SearchContext::SearchContext(Speller* speller_ptr):
+        speller(speller_ptr),
+        mutator(speller_ptr->mutator),
+        lexicon(speller_ptr->lexicon),
+        input(),
+        queue(TreeNodeQueue()),
+        flag_states(speller_ptr->get_state_size(),
+                    speller_ptr->lexicon->get_operations()),
+        next_node(NEUTRAL_FLAG_STATE),
+        limit(std::numeric_limits<Weight>::max()),
+        alphabet_translator(speller_ptr->alphabet_translator),
+        lexicon_keys(*speller_ptr->lexicon->get_key_table()),
+        operations(speller_ptr->operations),
+        cached_depth(1),
+        limiting(None),
+        mode(Correct),
+        search_order(DepthFirst),
+        caching(false),
+        deadline(Deadline::max()),
+        call_counter(0),
+        limit_reached(false),
+        parallel_threads(1),
+        parallel_min_length(0),
+        shared_limit(NULL),
+        best_first_nbest(0),
+        best_first_beam(-1.0)
+    {}
+
 
-void Speller::lexicon_epsilons(void)
+void SearchContext::lexicon_epsilons(void)
 {
     if (!lexicon->has_epsilons_or_flags(next_node.lexicon_state + 1)) {
         return;
     }
     TransitionTableIndex next = lexicon->next(next_node.lexicon_state, 0);
-    STransition i_s = lexicon->take_epsilons_and_flags(next);
-
-    while (i_s.symbol != NO_SYMBOL) {
-        if (is_under_weight_limit(next_node.weight + i_s.weight)) {
+    TransitionTableIndex end = lexicon->epsilon_run_end(next);
+    Weight still_to_come = remaining_cost(next_node.mutator_state,
+                                          next_node.input_state);
+
+    for (; next < end; ++next) {
+        STransition i_s = lexicon->take_transition(next);
+        if (is_under_weight_limit(next_node.weight + i_s.weight +
+                                  still_to_come)) {
             if (lexicon->transitions.input_symbol(next) == 0) {
-                queue.push_back(next_node.update_lexicon((mode == Correct) ? 0 : i_s.symbol,
+                queue.push_back(next_node.update_lexicon(paths,
+                                                         (mode == Correct) ? 0 : i_s.symbol,
                                                          i_s.index,
                                                          i_s.weight));
             } else {
-                FlagDiacriticState old_flags = next_node.flag_state;
-                if (next_node.try_compatible_with( // this is terrible
-                        operations->operator[](
-                            lexicon->transitions.input_symbol(next)))) {
-                    queue.push_back(next_node.update_lexicon(0,
+                FlagStateHandle old_flags = next_node.flag_state;
+                if (next_node.try_compatible_with(
+                        flag_states,
+                        lexicon->transitions.input_symbol(next))) {
+                    queue.push_back(next_node.update_lexicon(paths,
+                                                             0,
                                                              i_s.index,
                                                              i_s.weight));
                     next_node.flag_state = old_flags;
                 }
             }
         }
-        ++next;
-        i_s = lexicon->take_epsilons_and_flags(next);
     }
 }
 
-void Speller::lexicon_consume(void)
+void SearchContext::lexicon_consume(void)
 {
     unsigned int input_state = next_node.input_state;
     if (input_state >= input.size()) {
@@ -298,48 +1058,53 @@ void Speller::lexicon_consume(void)
                        next_node.mutator_state, 0.0, 1);
 }
 
-void Speller::queue_lexicon_arcs(SymbolNumber input_sym,
+void SearchContext::queue_lexicon_arcs(SymbolNumber input_sym,
                                  unsigned int mutator_state,
                                  Weight mutator_weight,
                                  int input_increment)
 {
     TransitionTableIndex next = lexicon->next(next_node.lexicon_state,
                                               input_sym);
-    STransition i_s = lexicon->take_non_epsilons(next, input_sym);
-    while (i_s.symbol != NO_SYMBOL) {
+    TransitionTableIndex end = lexicon->run_end(next, input_sym);
+    Weight still_to_come = remaining_cost(mutator_state,
+                                          next_node.input_state +
+                                          input_increment);
+    for (; next < end; ++next) {
+        STransition i_s = lexicon->take_transition(next);
         if (i_s.symbol == lexicon->get_identity()) {
             i_s.symbol = input[next_node.input_state];
         }
-        if (is_under_weight_limit(next_node.weight + i_s.weight + mutator_weight)) {
+        if (is_under_weight_limit(next_node.weight + i_s.weight +
+                                  mutator_weight + still_to_come)) {
             queue.push_back(next_node.update(
+                                paths,
                                 (mode == Correct) ? input_sym : i_s.symbol,
                                 next_node.input_state + input_increment,
                                 mutator_state,
                                 i_s.index,
                                 i_s.weight + mutator_weight));
         }
-        ++next;
-        i_s = lexicon->take_non_epsilons(next, input_sym);
     }
 }
 
-void Speller::mutator_epsilons(void)
+void SearchContext::mutator_epsilons(void)
 {
     if (!mutator->has_transitions(next_node.mutator_state + 1, 0)) {
         return;
     }
     TransitionTableIndex next_m = mutator->next(next_node.mutator_state, 0);
-    STransition mutator_i_s = mutator->take_epsilons(next_m);
+    TransitionTableIndex end_m = mutator->run_end(next_m, 0);
 
-    while (mutator_i_s.symbol != NO_SYMBOL) {
+    for (; next_m < end_m; ++next_m) {
+        STransition mutator_i_s = mutator->take_transition(next_m);
         if (mutator_i_s.symbol == 0) {
             if (is_under_weight_limit(
-                    next_node.weight + mutator_i_s.weight)) {
+                    next_node.weight + mutator_i_s.weight +
+                    remaining_cost(mutator_i_s.index,
+                                   next_node.input_state))) {
                 queue.push_back(next_node.update_mutator(mutator_i_s.index,
                                                          mutator_i_s.weight));
             }
-            ++next_m;
-            mutator_i_s = mutator->take_epsilons(next_m);
             continue;
         } else if (!lexicon->has_transitions(
                        next_node.lexicon_state + 1,
@@ -361,19 +1126,15 @@ void Speller::mutator_epsilons(void)
                                        mutator_i_s.index, mutator_i_s.weight);
                 }
             }
-            ++next_m;
-            mutator_i_s = mutator->take_epsilons(next_m);
             continue;
         }
         queue_lexicon_arcs(alphabet_translator[mutator_i_s.symbol],
                            mutator_i_s.index, mutator_i_s.weight);
-        ++next_m;
-        mutator_i_s = mutator->take_epsilons(next_m);
     }
 }
 
 
-bool Speller::is_under_weight_limit(Weight w) const
+bool SearchContext::is_under_weight_limit(Weight w) const
 {
     if (limiting == Nbest) {
         return w < limit;
@@ -381,7 +1142,7 @@ bool Speller::is_under_weight_limit(Weight w) const
     return w <= limit;
 }
 
-void Speller::consume_input()
+void SearchContext::consume_input()
 {
     if (next_node.input_state >= input.size()) {
         return; // not enough input to consume
@@ -409,23 +1170,24 @@ void Speller::consume_input()
     }
 }
 
-void Speller::queue_mutator_arcs(SymbolNumber input_sym)
+void SearchContext::queue_mutator_arcs(SymbolNumber input_sym)
 {
     TransitionTableIndex next_m = mutator->next(next_node.mutator_state,
                                                 input_sym);
-    STransition mutator_i_s = mutator->take_non_epsilons(next_m,
-                                                         input_sym);
-    while (mutator_i_s.symbol != NO_SYMBOL) {
+    TransitionTableIndex end_m = mutator->run_end(next_m, input_sym);
+    for (; next_m < end_m; ++next_m) {
+        STransition mutator_i_s = mutator->take_transition(next_m);
         if (mutator_i_s.symbol == 0) {
             if (is_under_weight_limit(
-                    next_node.weight + mutator_i_s.weight)) {
-                queue.push_back(next_node.update(0, next_node.input_state + 1,
+                    next_node.weight + mutator_i_s.weight +
+                    remaining_cost(mutator_i_s.index,
+                                   next_node.input_state + 1))) {
+                queue.push_back(next_node.update(paths, 0,
+                                                 next_node.input_state + 1,
                                                  mutator_i_s.index,
                                                  next_node.lexicon_state,
                                                  mutator_i_s.weight));
             }
-            ++next_m;
-            mutator_i_s = mutator->take_non_epsilons(next_m, input_sym);
             continue;
         } else if (!lexicon->has_transitions(
                     next_node.lexicon_state + 1,
@@ -447,15 +1209,10 @@ void Speller::queue_mutator_arcs(SymbolNumber input_sym)
                                            mutator_i_s.index, mutator_i_s.weight, 1);
                     }
                 }
-                ++next_m;
-                mutator_i_s = mutator->take_non_epsilons(next_m, input_sym);
                 continue;
         }
         queue_lexicon_arcs(alphabet_translator[mutator_i_s.symbol],
                            mutator_i_s.index, mutator_i_s.weight, 1);
-        ++next_m;
-        mutator_i_s = mutator->take_non_epsilons(next_m,
-                                                 input_sym);
     }
 }
 
@@ -483,10 +1240,13 @@ AnalysisQueue Transducer::lookup(char * line)
     AnalysisQueue analyses;
     SymbolVector input;
     TreeNodeQueue queue;
+    PathArena paths;
+    FlagStatePool flag_states(static_cast<SymbolNumber>(get_state_size()),
+                              get_operations());
     if (!initialize_input_vector(input, &encoder, line)) {
         return analyses;
     }
-    TreeNode start_node(FlagDiacriticState(get_state_size(), 0));
+    TreeNode start_node(NEUTRAL_FLAG_STATE);
     queue.assign(1, start_node);
 
     while (queue.size() > 0) {
@@ -499,7 +1259,7 @@ AnalysisQueue Transducer::lookup(char * line)
             Weight weight = next_node.weight +
                 final_weight(next_node.lexicon_state);
             std::string output = stringify(get_key_table(),
-                                           next_node.string);
+                                           paths, next_node.output);
             /* if the result is novel or lower weighted than before, insert it */
             if (outputs.count(output) == 0 ||
                 outputs[output] > weight) {
@@ -511,26 +1271,27 @@ AnalysisQueue Transducer::lookup(char * line)
         // epsilon loop
         if (has_epsilons_or_flags(next_node.lexicon_state + 1)) {
             next_index = next(next_node.lexicon_state, 0);
-            STransition i_s = take_epsilons_and_flags(next_index);
-            while (i_s.symbol != NO_SYMBOL) {
+            TransitionTableIndex end = epsilon_run_end(next_index);
+            for (; next_index < end; ++next_index) {
+                STransition i_s = take_transition(next_index);
                 if (transitions.input_symbol(next_index) == 0) {
-                    queue.push_back(next_node.update_lexicon(i_s.symbol,
+                    queue.push_back(next_node.update_lexicon(paths,
+                                                             i_s.symbol,
                                                              i_s.index,
                                                              i_s.weight));
                     // Not a true epsilon but a flag diacritic
                 } else {
-                    FlagDiacriticState old_flags = next_node.flag_state;
+                    FlagStateHandle old_flags = next_node.flag_state;
                     if (next_node.try_compatible_with(
-                            get_operations()->operator[](
-                                transitions.input_symbol(next_index)))) {
-                        queue.push_back(next_node.update_lexicon(i_s.symbol,
+                            flag_states,
+                            transitions.input_symbol(next_index))) {
+                        queue.push_back(next_node.update_lexicon(paths,
+                                                                 i_s.symbol,
                                                                  i_s.index,
                                                                  i_s.weight));
                         next_node.flag_state = old_flags;
                     }
                 }
-                ++next_index;
-                i_s = take_epsilons_and_flags(next_index);
             }
         }
 
@@ -542,19 +1303,18 @@ AnalysisQueue Transducer::lookup(char * line)
 
             next_index = next(next_node.lexicon_state,
                               input[input_state]);
-            STransition i_s = take_non_epsilons(next_index,
-                                                input[input_state]);
+            TransitionTableIndex end = run_end(next_index,
+                                               input[input_state]);
 
-            while (i_s.symbol != NO_SYMBOL) {
+            for (; next_index < end; ++next_index) {
+                STransition i_s = take_transition(next_index);
                 queue.push_back(next_node.update(
+                                    paths,
                                     i_s.symbol,
                                     input_state + 1,
                                     next_node.mutator_state,
                                     i_s.index,
                                     i_s.weight));
-
-                ++next_index;
-                i_s = take_non_epsilons(next_index, input[input_state]);
             }
         }
 
@@ -621,10 +1381,10 @@ Transducer::get_alphabet()
     return &alphabet;
 }
 
-OperationMap*
-Transducer::get_operations()
+const OperationTable*
+Transducer::get_operations() const
 {
-    return alphabet.get_operation_map();
+    return alphabet.get_operation_table();
 }
 
 TransitionTableIndex Transducer::next(const TransitionTableIndex i,
@@ -709,6 +1469,25 @@ STransition Transducer::take_non_epsilons(const TransitionTableIndex i,
                        transitions.weight(i));
 }
 
+STransition Transducer::take_transition(const TransitionTableIndex i) const
+{
+    return STransition(transitions.target(i),
+                       transitions.output_symbol(i),
+                       transitions.weight(i));
+}
+
+TransitionTableIndex Transducer::run_end(const TransitionTableIndex i,
+                                         const SymbolNumber symbol) const
+{
+    return transitions.run_end(i, symbol);
+}
+
+TransitionTableIndex
+Transducer::epsilon_run_end(const TransitionTableIndex i)
+{
+    return transitions.epsilon_run_end(i, alphabet.get_flag_symbols());
+}
+
 bool Transducer::is_final(const TransitionTableIndex i)
 {
     if (i >= TARGET_TABLE) {
@@ -728,7 +1507,7 @@ Weight Transducer::final_weight(const TransitionTableIndex i) const
 }
 
 bool
-Transducer::is_flag(const SymbolNumber symbol)
+Transducer::is_flag(const SymbolNumber symbol) const
 {
     return alphabet.is_flag(symbol);
 }
@@ -739,8 +1518,199 @@ Transducer::is_weighted(void)
     return header.probe_flag(Weighted);
 }
 
+TransitionTableIndex
+Transducer::index_table_size(void)
+{
+    return header.index_table_size();
+}
 
-AnalysisQueue Speller::analyse(char * line, int nbest)
+TransitionTableIndex
+Transducer::target_table_size(void)
+{
+    return header.target_table_size();
+}
+
+const unsigned int RemainingCostTable::MAX_REMAINING;
+const uint32_t RemainingCostTable::NO_ROW;
+
+RemainingCostTable::RemainingCostTable(void):
+    index_table_size(0)
+    {}
+
+uint32_t RemainingCostTable::row(TransitionTableIndex state) const
+{
+    size_t position = (state >= TARGET_TABLE) ?
+        index_table_size + (state - TARGET_TABLE) : state;
+    if (position >= rows.size()) {
+        return NO_ROW;
+    }
+    return rows[position];
+}
+
+void RemainingCostTable::build(Transducer & mutator)
+{
+    struct Arc
+    {
+        uint32_t source;
+        Weight weight;
+        bool consumes;
+    };
+    const unsigned int width = MAX_REMAINING + 1;
+    const Weight infinity = std::numeric_limits<Weight>::infinity();
+    TransitionTableIndex target_table_size = mutator.target_table_size();
+    index_table_size = mutator.index_table_size();
+    SymbolNumber symbol_count = mutator.get_alphabet()->get_orig_symbol_count();
+    rows.assign(index_table_size + target_table_size, NO_ROW);
+    costs.clear();
+
+    // Number the states reachable from the start and gather their arcs,
+    // reversed. Arcs that the search can't actually take only make the
+    // estimates lower, so every transition of a state is counted.
+    std::vector<TransitionTableIndex> states;
+    std::vector<std::vector<Arc> > arcs_into;
+    bool negative = false;
+    states.push_back(0);
+    rows[0] = 0;
+    arcs_into.push_back(std::vector<Arc>());
+    for (uint32_t source = 0; source < states.size() && !negative; ++source) {
+        TransitionTableIndex state = states[source];
+        std::vector<TransitionTableIndex> first_transitions;
+        if (state >= TARGET_TABLE) {
+            first_transitions.push_back(state - TARGET_TABLE + 1);
+        } else {
+            for (SymbolNumber sym = 0; sym < symbol_count; ++sym) {
+                if (state + 1 + sym < index_table_size &&
+                    mutator.indices.input_symbol(state + 1 + sym) == sym) {
+                    first_transitions.push_back(
+                        mutator.indices.target(state + 1 + sym) - TARGET_TABLE);
+                }
+            }
+        }
+        for (auto first : first_transitions) {
+            if (first >= target_table_size) {
+                continue;
+            }
+            // transition-table states list all their arcs in one run,
+            // index-table ones have a run per input symbol
+            SymbolNumber run_symbol = mutator.transitions.input_symbol(first);
+            for (TransitionTableIndex i = first;
+                 i < target_table_size &&
+                     mutator.transitions.input_symbol(i) != NO_SYMBOL &&
+                     (state >= TARGET_TABLE ||
+                      mutator.transitions.input_symbol(i) == run_symbol);
+                 ++i) {
+                TransitionTableIndex target = mutator.transitions.target(i);
+                size_t position = (target >= TARGET_TABLE) ?
+                    index_table_size + (target - TARGET_TABLE) : target;
+                if (position >= rows.size()) {
+                    continue;
+                }
+                if (rows[position] == NO_ROW) {
+                    rows[position] = static_cast<uint32_t>(states.size());
+                    states.push_back(target);
+                    arcs_into.push_back(std::vector<Arc>());
+                }
+                Arc arc;
+                arc.source = source;
+                arc.weight = mutator.transitions.weight(i);
+                arc.consumes = mutator.transitions.input_symbol(i) != 0;
+                negative = negative || arc.weight < 0.0;
+                arcs_into[rows[position]].push_back(arc);
+            }
+        }
+    }
+
+    // Backwards from the final states, cheapest first
+    typedef std::pair<Weight, uint32_t> Reached;
+    std::priority_queue<Reached, std::vector<Reached>,
+                        std::greater<Reached> > agenda;
+    costs.assign(states.size() * width, infinity);
+    for (uint32_t r = 0; r < states.size() && !negative; ++r) {
+        if (mutator.is_final(states[r])) {
+            Weight weight = mutator.final_weight(states[r]);
+            negative = weight < 0.0;
+            costs[r * width] = weight;
+            agenda.push(Reached(weight, r * width));
+        }
+    }
+    if (negative) {
+        // the estimates wouldn't be lower bounds
+        rows.clear();
+        costs.clear();
+        return;
+    }
+    while (agenda.size() > 0) {
+        Reached reached = agenda.top();
+        agenda.pop();
+        if (reached.first > costs[reached.second]) {
+            continue;
+        }
+        uint32_t target = reached.second / width;
+        unsigned int remaining = reached.second % width;
+        for (auto& arc : arcs_into[target]) {
+            // consuming from "at least MAX_REMAINING" leaves at least
+            // MAX_REMAINING - 1, which both rows bound from below
+            unsigned int source_remaining = remaining;
+            if (arc.consumes) {
+                source_remaining = std::min(remaining + 1, MAX_REMAINING);
+            }
+            uint32_t source = arc.source * width + source_remaining;
+            Weight weight = reached.first + arc.weight;
+            if (weight < costs[source]) {
+                costs[source] = weight;
+                agenda.push(Reached(weight, source));
+            }
+        }
+    }
+}
+
+void RemainingCostTable::write(std::string & blob) const
+{
+    put_u32(blob, index_table_size);
+    put_u32(blob, static_cast<uint32_t>(rows.size()));
+    put_column(blob, rows.data(), rows.size() * sizeof(uint32_t));
+    put_u32(blob, static_cast<uint32_t>(costs.size()));
+    put_column(blob, costs.data(), costs.size() * sizeof(Weight));
+}
+
+void RemainingCostTable::read(ImageReader & image)
+{
+    index_table_size = image.read_u32();
+    uint32_t row_count = image.read_u32();
+    const char * row_column = image.read_column(row_count *
+                                                sizeof(uint32_t));
+    uint32_t cost_count = image.read_u32();
+    const char * cost_column = image.read_column(cost_count *
+                                                 sizeof(Weight));
+    rows.resize(row_count);
+    memcpy(rows.data(), row_column, row_count * sizeof(uint32_t));
+    costs.resize(cost_count);
+    memcpy(costs.data(), cost_column, cost_count * sizeof(Weight));
+    for (auto r : rows) {
+        if (r != NO_ROW && r >= cost_count / (MAX_REMAINING + 1)) {
+            HFSTOSPELL_THROW(ImageReadingException);
+        }
+    }
+}
+
+bool RemainingCostTable::empty(void) const
+{
+    return costs.size() == 0;
+}
+
+Weight RemainingCostTable::get(TransitionTableIndex state,
+                               unsigned int remaining) const
+{
+    uint32_t r = row(state);
+    if (r == NO_ROW) {
+        return 0.0;
+    }
+    return costs[r * (MAX_REMAINING + 1) +
+                 std::min(remaining, MAX_REMAINING)];
+}
+
+
+AnalysisQueue SearchContext::analyse(char * line, int nbest)
 {
     (void)nbest;
     mode = Lookup;
@@ -749,8 +1719,10 @@ AnalysisQueue Speller::analyse(char * line, int nbest)
     }
     std::map<std::string, Weight> outputs;
     AnalysisQueue analyses;
-    TreeNode start_node(FlagDiacriticState(get_state_size(), 0));
+    TreeNode start_node(NEUTRAL_FLAG_STATE);
     queue.assign(1, start_node);
+    paths.clear();
+    flag_states.clear();
     while (queue.size() > 0) {
         next_node = queue.back();
         queue.pop_back();
@@ -759,8 +1731,8 @@ AnalysisQueue Speller::analyse(char * line, int nbest)
             lexicon->is_final(next_node.lexicon_state)) {
             Weight weight = next_node.weight +
                 lexicon->final_weight(next_node.lexicon_state);
-            std::string output = stringify(lexicon->get_key_table(),
-                                           next_node.string);
+            std::string output = stringify(&lexicon_keys,
+                                           paths, next_node.output);
             /* if the result is novel or lower weighted than before, insert it */
             if (outputs.count(output) == 0 ||
                 outputs[output] > weight) {
@@ -778,7 +1750,7 @@ AnalysisQueue Speller::analyse(char * line, int nbest)
 }
 
 
-AnalysisSymbolsQueue Speller::analyseSymbols(char * line, int nbest)
+AnalysisSymbolsQueue SearchContext::analyseSymbols(char * line, int nbest)
 {
     (void)nbest;
     mode = Lookup;
@@ -787,8 +1759,10 @@ AnalysisSymbolsQueue Speller::analyseSymbols(char * line, int nbest)
     }
     std::map<std::vector<std::string>, Weight> outputs;
     AnalysisSymbolsQueue analyses;
-    TreeNode start_node(FlagDiacriticState(get_state_size(), 0));
+    TreeNode start_node(NEUTRAL_FLAG_STATE);
     queue.assign(1, start_node);
+    paths.clear();
+    flag_states.clear();
     while (queue.size() > 0) {
         next_node = queue.back();
         queue.pop_back();
@@ -797,8 +1771,8 @@ AnalysisSymbolsQueue Speller::analyseSymbols(char * line, int nbest)
             lexicon->is_final(next_node.lexicon_state)) {
             Weight weight = next_node.weight +
                 lexicon->final_weight(next_node.lexicon_state);
-            std::vector<std::string> output = symbolify(lexicon->get_key_table(),
-                                                        next_node.string);
+            std::vector<std::string> output = symbolify(&lexicon_keys,
+                                                        paths, next_node.output);
             /* if the result is novel or lower weighted than before, insert it */
             if (outputs.count(output) == 0 ||
                 outputs[output] > weight) {
@@ -817,10 +1791,26 @@ AnalysisSymbolsQueue Speller::analyseSymbols(char * line, int nbest)
 
 
 
-void Speller::build_cache(SymbolNumber first_sym)
+CacheContainer & SearchContext::get_cache(SymbolNumber first_sym)
 {
-    TreeNode start_node(FlagDiacriticState(get_state_size(), 0));
+    if (first_sym < speller->cache.size()) {
+        return speller->get_cache(first_sym);
+    }
+    // the symbol only means something for this input
+    unknown_cache.clear();
+    build_cache(first_sym, unknown_cache);
+    return unknown_cache;
+}
+
+void SearchContext::build_cache(SymbolNumber first_sym,
+                                CacheContainer & entry)
+{
+    caching = true;
+    limiting = None;
+    TreeNode start_node(NEUTRAL_FLAG_STATE);
     queue.assign(1, start_node);
+    paths.clear();
+    flag_states.clear();
     limit = std::numeric_limits<Weight>::max();
     // A placeholding map, only one weight per correction
     StringWeightMap corrections_len_0;
@@ -836,7 +1826,8 @@ void Speller::build_cache(SymbolNumber first_sym)
             Weight weight = next_node.weight +
                 lexicon->final_weight(next_node.lexicon_state) +
                 mutator->final_weight(next_node.mutator_state);
-            std::string string = stringify(lexicon->get_key_table(), next_node.string);
+            std::string string = stringify(&lexicon_keys,
+                                           paths, next_node.output);
             /* if the correction is novel or better than before, insert it
              */
             if (next_node.input_state == 0) {
@@ -852,7 +1843,7 @@ void Speller::build_cache(SymbolNumber first_sym)
             }
         }
         if (next_node.input_state == 1) {
-            cache[first_sym].nodes.push_back(next_node);
+            entry.nodes.push_back(next_node);
         } else {
 //            std::cerr << "discarded node\n";
         }
@@ -860,87 +1851,204 @@ void Speller::build_cache(SymbolNumber first_sym)
             consume_input();
         }
     }
-    cache[first_sym].results_len_0.assign(corrections_len_0.begin(), corrections_len_0.end());
-    cache[first_sym].results_len_1.assign(corrections_len_1.begin(), corrections_len_1.end());
-    cache[first_sym].empty = false;
+    entry.results_len_0.assign(corrections_len_0.begin(), corrections_len_0.end());
+    entry.results_len_1.assign(corrections_len_1.begin(), corrections_len_1.end());
+    // the cached nodes' output strings and flag states live on in the cache
+    std::swap(entry.paths, paths);
+    paths.clear();
+    entry.flag_states = flag_states;
+    flag_states.clear();
+    entry.empty = false;
+    caching = false;
 }
 
-CorrectionQueue Speller::correct(char * line, int nbest,
+const CacheContainer &
+SearchContext::get_prefix_cache(const CacheContainer & first_cache)
+{
+    prefix_entry.reset();
+    cached_depth = 1;
+    if (input.size() == 0 || input[0] >= speller->cache.size() ||
+        !speller->prefix_cache.enabled()) {
+        return first_cache;
+    }
+    // the longest prefix that leaves input to search below it, made of
+    // symbols that mean the same for every input
+    unsigned int max_depth = speller->prefix_depth;
+    unsigned int depth = 1;
+    while (depth < max_depth && depth + 1 < input.size() &&
+           input[depth] < speller->cache.size()) {
+        ++depth;
+    }
+    std::string key(reinterpret_cast<const char *>(&input[0]),
+                    sizeof(SymbolNumber));
+    const CacheContainer * parent = &first_cache;
+    for (unsigned int prefix = 2; prefix <= depth; ++prefix) {
+        key.append(reinterpret_cast<const char *>(&input[prefix - 1]),
+                   sizeof(SymbolNumber));
+        std::shared_ptr<const CacheContainer> entry =
+            speller->prefix_cache.find(key);
+        if (!entry) {
+            std::shared_ptr<CacheContainer> built =
+                std::make_shared<CacheContainer>();
+            built->parent = prefix_entry;
+            build_prefix_cache(*parent, *built);
+            speller->prefix_cache.insert(key, built);
+            entry = built;
+        }
+        prefix_entry = entry;
+        parent = entry.get();
+    }
+    cached_depth = depth;
+    return *parent;
+}
+
+void SearchContext::build_prefix_cache(const CacheContainer & parent,
+                                       CacheContainer & entry)
+{
+    caching = true;
+    limit = std::numeric_limits<Weight>::max();
+    queue.clear();
+    paths.clear(&parent.paths);
+    // flag state pools only layer one deep, so this one starts as a copy
+    flag_states = parent.flag_states;
+    // the parent's nodes have their epsilons followed already
+    for (auto & node : parent.nodes) {
+        next_node = node;
+        consume_input();
+    }
+    while (queue.size() > 0) {
+        next_node = queue.back();
+        queue.pop_back();
+        lexicon_epsilons();
+        mutator_epsilons();
+        entry.nodes.push_back(next_node);
+    }
+    // the cached nodes' output strings and flag states live on in the cache
+    std::swap(entry.paths, paths);
+    paths.clear();
+    entry.flag_states = flag_states;
+    flag_states.clear();
+    entry.bytes = sizeof(CacheContainer) +
+        entry.nodes.capacity() * sizeof(TreeNode) +
+        entry.paths.memory_size() + entry.flag_states.memory_size();
+    entry.empty = false;
+    caching = false;
+}
+
+// Push those of @a candidates within @a limit to @a correction_queue,
+// only the @a nbest cheapest of them unless @a nbest is 0. Ties go by
+// the order of @a candidates, so the result doesn't depend on the order
+// the search found them in when that is a StringWeightMap.
+template <class Candidates>
+static void push_cheapest(const Candidates & candidates, Weight limit,
+                          int nbest, CorrectionQueue & correction_queue)
+{
+    std::vector<StringWeightPair> within;
+    for (auto & it : candidates) {
+        if (it.second <= limit) {
+            within.push_back(StringWeightPair(it.first, it.second));
+        }
+    }
+    size_t keep = within.size();
+    if (nbest > 0 && static_cast<size_t>(nbest) < keep) {
+        keep = nbest;
+        std::stable_sort(within.begin(), within.end(),
+                         [](const StringWeightPair & a,
+                            const StringWeightPair & b) {
+                             return a.second < b.second;
+                         });
+    }
+    for (size_t i = 0; i < keep; ++i) {
+        correction_queue.push(within[i]);
+    }
+}
+
+CorrectionQueue SearchContext::correct(char * line, int nbest,
                                  Weight maxweight, Weight beam,
                                  float time_cutoff)
 {
+    return correct_until(line, deadline_in(time_cutoff),
+                         nbest, maxweight, beam);
+}
+
+CorrectionQueue SearchContext::correct_until(char * line, Deadline until,
+                                             int nbest, Weight maxweight,
+                                             Weight beam)
+{
+    if (search_order == BestFirst) {
+        // take the corrections as they come, until there are no more
+        CorrectionQueue correction_queue;
+        StringWeightPair correction;
+        start_correcting(line, nbest, maxweight, beam, until);
+        while (next_correction(correction)) {
+            correction_queue.push(correction);
+        }
+        return correction_queue;
+    }
     mode = Correct;
+    deadline = until;
+    call_counter = 0;
+    limit_reached = false;
     // if input initialization fails, return empty correction queue
     if (!init_input(line)) {
         return CorrectionQueue();
     }
-    max_time = 0.0;
-    if (time_cutoff > 0.0) {
-        max_time = time_cutoff;
-        start_clock = clock();
-        call_counter = 0;
-        limit_reached = false;
-    }
-    set_limiting_behaviour(nbest, maxweight, beam);
-    nbest_queue = WeightQueue();
+    nbest_queue.reset(nbest > 0 ? nbest : 0);
     // The queue for our suggestions
     CorrectionQueue correction_queue;
     // A placeholding map, only one weight per correction
-    std::map<std::string, Weight> corrections;
+    StringWeightMap corrections;
     SymbolNumber first_input = (input.size() == 0) ? 0 : input[0];
-    if (cache[first_input].empty) {
-        build_cache(first_input); // XXX: cache corrupts limit!
-    }
+    CacheContainer & first_cache = get_cache(first_input);
+    const CacheContainer & start_cache = get_prefix_cache(first_cache);
+    // The limit is set up once here, after caching, and from then on
+    // only moves when a new correction turns up
+    set_limiting_behaviour(nbest, maxweight, beam);
     if (input.size() <= 1) {
         // get the cached results and we're done
         StringWeightVector * results;
         if (input.size() == 0) {
-            results = &cache[first_input].results_len_0;
+            results = &first_cache.results_len_0;
         } else {
-            results = &cache[first_input].results_len_1;
+            results = &first_cache.results_len_1;
         }
         for(auto& it : *results) {
               // First get the correct weight limit
                 best_suggestion = std::min(best_suggestion, it.second);
                 if (nbest > 0) {
                     nbest_queue.push(it.second);
-                    if (nbest_queue.size() > nbest) {
-                        nbest_queue.pop();
-                    }
                 }
             }
-        set_limiting_behaviour(nbest, maxweight, beam);
         adjust_weight_limits(nbest, beam);
-        for(auto& it : *results) {
-              // Then collect the results
-            if (it.second <= limit && (nbest == 0 || // we either don't have an nbest condition or
-                                        (it.second <= nbest_queue.get_highest() && // we're below the worst nbest weight and
-                                         correction_queue.size() < nbest &&
-                                         nbest_queue.size() > 0))) { // number of results
-                correction_queue.push(StringWeightPair(it.first, it.second));
-                if (nbest != 0) {
-                    nbest_queue.pop();
-                }
-            }
-        }
+        // Then collect the results
+        push_cheapest(*results, limit, nbest, correction_queue);
         return correction_queue;
     } else {
         // populate the tree node queue
-        queue.assign(cache[first_input].nodes.begin(), cache[first_input].nodes.end());
+        queue.assign(start_cache.nodes.begin(), start_cache.nodes.end());
+        paths.clear(&start_cache.paths);
+        flag_states.clear(&start_cache.flag_states);
+    }
+    if (parallel_threads > 1 && input.size() >= parallel_min_length &&
+        start_cache.nodes.size() > 1) {
+        correct_parallel(nbest, beam, start_cache, corrections);
+    } else {
+        correct_depth_first(nbest, beam, corrections);
     }
-    // TreeNode start_node(FlagDiacriticState(get_state_size(), 0));
-    // queue.assign(1, start_node);
+    adjust_weight_limits(nbest, beam);
+
+    push_cheapest(corrections, limit, nbest, correction_queue);
+    //cache[first_input].clear();
+    return correction_queue;
+}
 
+void SearchContext::correct_depth_first(int nbest, Weight beam,
+                                        StringWeightMap & corrections)
+{
     while (queue.size() > 0) {
         // Have we spent too much time?
-        if (max_time > 0.0) {
-            ++call_counter;
-            if (limit_reached ||
-                (call_counter % 1000000 == 0 &&
-                 (((double)(clock() - start_clock)) / CLOCKS_PER_SEC) > max_time)) {
-                limit_reached = true;
-                break;
-            }
+        if (time_is_up()) {
+            break;
         }
         /*
           For depth-first searching, we save the back node now, remove it
@@ -948,13 +2056,16 @@ CorrectionQueue Speller::correct(char * line, int nbest,
         */
         next_node = queue.back();
         queue.pop_back();
-        set_limiting_behaviour(nbest, maxweight, beam); // XXX: need to reset
-        adjust_weight_limits(nbest, beam);
+        if (shared_limit != NULL) {
+            // others' corrections count as much as ours
+            limit = std::min(limit,
+                             shared_limit->load(std::memory_order_relaxed));
+        }
         // if we can't get an acceptable result, never mind
-        if (next_node.weight > limit) {
+        if (next_node.weight + heuristic(next_node) > limit) {
             continue;
         }
-        if (next_node.input_state > 1) {
+        if (next_node.input_state > cached_depth) {
             // Early epsilons were handled during the caching stage
             lexicon_epsilons();
             mutator_epsilons();
@@ -975,17 +2086,30 @@ CorrectionQueue Speller::correct(char * line, int nbest,
                 if (weight > limit) {
                     continue;
                 }
-                std::string string = stringify(lexicon->get_key_table(), next_node.string);
+                std::string string = stringify(&lexicon_keys,
+                                               paths, next_node.output);
                 /* if the correction is novel or better than before, insert it
                  */
-                if (corrections.count(string) == 0 ||
-                    corrections[string] > weight) {
+                auto known = corrections.find(string);
+                if (known == corrections.end() || known->second > weight) {
+                    if (nbest > 0) {
+                        // each correction counts once among the n best
+                        if (known == corrections.end()) {
+                            nbest_queue.push(weight);
+                        } else {
+                            nbest_queue.replace(known->second, weight);
+                        }
+                    }
                     corrections[string] = weight;
                     best_suggestion = std::min(best_suggestion, weight);
-                    if (nbest > 0) {
-                        nbest_queue.push(weight);
-                        if (nbest_queue.size() > nbest) {
-                            nbest_queue.pop();
+                    adjust_weight_limits(nbest, beam);
+                    if (shared_limit != NULL) {
+                        Weight shared =
+                            shared_limit->load(std::memory_order_relaxed);
+                        while (limit < shared &&
+                               !shared_limit->compare_exchange_weak(
+                                   shared, limit,
+                                   std::memory_order_relaxed)) {
                         }
                     }
                 }
@@ -994,25 +2118,268 @@ CorrectionQueue Speller::correct(char * line, int nbest,
             consume_input();
         }
     }
-    adjust_weight_limits(nbest, beam);
+}
 
-    for (auto& it : corrections) {
-        if (it.second <= limit && // we're not over our weight limit and
-            (nbest == 0 || // we either don't have an nbest condition or
-             (it.second <= nbest_queue.get_highest() && // we're below the worst nbest weight and
-              correction_queue.size() < nbest &&
-              nbest_queue.size() > 0))) { // number of results
-            correction_queue.push(StringWeightPair(it.first, it.second));
-            if (nbest != 0) {
-                nbest_queue.pop();
+void SearchContext::correct_parallel(int nbest, Weight beam,
+                                     const CacheContainer & first_cache,
+                                     StringWeightMap & corrections)
+{
+    const TreeNodeQueue & frontier = first_cache.nodes;
+    std::atomic<Weight> bound(limit);
+    std::atomic<size_t> taken(0);
+    std::vector<SearchContext *> contexts(1, this);
+    size_t threads = std::min<size_t>(parallel_threads, frontier.size());
+    while (contexts.size() < threads) {
+        SearchContext * helper = speller->acquire_context();
+        helper->share_query(*this, first_cache);
+        contexts.push_back(helper);
+    }
+    std::vector<StringWeightMap> found(contexts.size());
+    std::exception_ptr failure;
+    std::mutex failure_mutex;
+    auto work = [&](size_t i) {
+        SearchContext * context = contexts[i];
+        StringWeightMap & own = (i == 0) ? corrections : found[i];
+        context->shared_limit = &bound;
+        try {
+            while (true) {
+                size_t next = taken.fetch_add(1);
+                if (next >= frontier.size()) {
+                    break;
+                }
+                // from the back, in the order of the unsplit search
+                context->queue.assign(1,
+                                      frontier[frontier.size() - 1 - next]);
+                context->correct_depth_first(nbest, beam, own);
             }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(failure_mutex);
+            if (!failure) {
+                failure = std::current_exception();
+            }
+            // leave the rest of the frontier so the others finish up
+            taken.store(frontier.size());
         }
+        context->shared_limit = NULL;
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < contexts.size(); ++i) {
+        workers.push_back(std::thread(work, i));
     }
-    //cache[first_input].clear();
-    return correction_queue;
+    work(0);
+    for (auto & worker : workers) {
+        worker.join();
+    }
+    for (size_t i = 1; i < contexts.size(); ++i) {
+        for (auto & it : found[i]) {
+            auto known = corrections.find(it.first);
+            if (known == corrections.end()) {
+                corrections.insert(it);
+            } else if (known->second > it.second) {
+                known->second = it.second;
+            }
+        }
+        limit_reached = limit_reached || contexts[i]->limit_reached;
+        speller->release_context(contexts[i]);
+    }
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+    // the n best and the beam are of everyone's corrections, each string
+    // counted once however many contexts found it
+    nbest_queue.reset(nbest > 0 ? nbest : 0);
+    for (auto & it : corrections) {
+        best_suggestion = std::min(best_suggestion, it.second);
+        if (nbest > 0) {
+            nbest_queue.push(it.second);
+        }
+    }
+    limit = std::min(limit, bound.load());
+}
+
+void SearchContext::share_query(const SearchContext & owner,
+                                const CacheContainer & first_cache)
+{
+    mode = owner.mode;
+    input = owner.input;
+    alphabet_translator = owner.alphabet_translator;
+    lexicon_keys = owner.lexicon_keys;
+    lexicon_unknowns = owner.lexicon_unknowns;
+    mutator_unknowns = owner.mutator_unknowns;
+    limiting = owner.limiting;
+    limit = owner.limit;
+    best_suggestion = owner.best_suggestion;
+    nbest_queue = owner.nbest_queue;
+    cached_depth = owner.cached_depth;
+    caching = false;
+    deadline = owner.deadline;
+    call_counter = 0;
+    limit_reached = false;
+    paths.clear(&first_cache.paths);
+    flag_states.clear(&first_cache.flag_states);
+}
+
+// Orders a heap of nodes cheapest first, by weight and heuristic()
+struct BestFirstOrder
+{
+    const SearchContext * context;
+
+    explicit BestFirstOrder(const SearchContext * search) : context(search)
+    {}
+    bool operator()(const TreeNode & a, const TreeNode & b) const
+    {
+        return a.weight + context->heuristic(a) >
+            b.weight + context->heuristic(b);
+    }
+};
+
+bool SearchContext::start_correcting(char * line, int nbest,
+                                     Weight maxweight, Weight beam,
+                                     Deadline until)
+{
+    mode = Correct;
+    deadline = until;
+    call_counter = 0;
+    limit_reached = false;
+    queue.clear();
+    pending = CorrectionQueue();
+    handed_out.clear();
+    best_first_nbest = nbest;
+    best_first_beam = beam;
+    if (!init_input(line)) {
+        // with nothing queued or pending there is nothing to hand out
+        return false;
+    }
+    SymbolNumber first_input = (input.size() == 0) ? 0 : input[0];
+    CacheContainer & first_cache = get_cache(first_input);
+    const CacheContainer & start_cache = get_prefix_cache(first_cache);
+    set_limiting_behaviour(nbest, maxweight, beam);
+    if (input.size() <= 1) {
+        // The cached results are complete, so they just wait their turn
+        const StringWeightVector & results = (input.size() == 0) ?
+            first_cache.results_len_0 : first_cache.results_len_1;
+        for (auto & it : results) {
+            pending.push(it);
+        }
+    } else {
+        queue.assign(start_cache.nodes.begin(), start_cache.nodes.end());
+        paths.clear(&start_cache.paths);
+        flag_states.clear(&start_cache.flag_states);
+        std::make_heap(queue.begin(), queue.end(), BestFirstOrder(this));
+    }
+    return true;
+}
+
+bool SearchContext::next_correction(StringWeightPair & correction)
+{
+    if (best_first_nbest > 0 &&
+        handed_out.size() >= (size_t) best_first_nbest) {
+        return false;
+    }
+    BestFirstOrder priority_order(this);
+    while (true) {
+        // When out of time, settle for what has been found so far
+        bool exhausted = (queue.size() == 0 || time_is_up());
+        Weight frontier = std::numeric_limits<Weight>::max();
+        if (!exhausted) {
+            frontier = queue.front().weight + heuristic(queue.front());
+        }
+        // Everything still in the queue ends up at least as heavy as
+        // frontier, so pending corrections under it are final
+        while (pending.size() > 0 && pending.top().second <= frontier) {
+            correction = pending.top();
+            pending.pop();
+            if (correction.second > limit ||
+                !handed_out.insert(correction.first).second) {
+                continue;
+            }
+            if (handed_out.size() == 1 && best_first_beam >= 0.0) {
+                best_suggestion = correction.second;
+                limit = std::min(limit, best_suggestion + best_first_beam);
+            }
+            return true;
+        }
+        if (exhausted || frontier > limit) {
+            return false;
+        }
+        std::pop_heap(queue.begin(), queue.end(), priority_order);
+        next_node = queue.back();
+        queue.pop_back();
+        size_t expanded_from = queue.size();
+        if (next_node.input_state > cached_depth) {
+            // Early epsilons were handled during the caching stage
+            lexicon_epsilons();
+            mutator_epsilons();
+        }
+        if (next_node.input_state == input.size()) {
+            if (mutator->is_final(next_node.mutator_state) &&
+                lexicon->is_final(next_node.lexicon_state)) {
+                Weight weight = next_node.weight +
+                    lexicon->final_weight(next_node.lexicon_state) +
+                    mutator->final_weight(next_node.mutator_state);
+                if (weight <= limit) {
+                    pending.push(StringWeightPair(
+                                     stringify(&lexicon_keys,
+                                               paths, next_node.output),
+                                     weight));
+                }
+            }
+        } else {
+            consume_input();
+        }
+        for (size_t i = expanded_from + 1; i <= queue.size(); ++i) {
+            std::push_heap(queue.begin(), queue.begin() + i, priority_order);
+        }
+    }
+}
+
+Weight SearchContext::heuristic(const TreeNode & node) const
+{
+    return remaining_cost(node.mutator_state, node.input_state);
+}
+
+Weight SearchContext::remaining_cost(TransitionTableIndex mutator_state,
+                               unsigned int input_state) const
+{
+    if (mode != Correct || caching || speller->remaining_costs.empty()) {
+        return 0.0;
+    }
+    return speller->remaining_costs.get(mutator_state,
+                               static_cast<unsigned int>(input.size()) -
+                               input_state);
+}
+
+Deadline deadline_in(double seconds)
+{
+    if (seconds <= 0.0) {
+        return Deadline::max();
+    }
+    return std::chrono::steady_clock::now() +
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(seconds));
+}
+
+// search steps between looks at the clock
+const unsigned int TIME_CHECK_INTERVAL = 64;
+
+bool SearchContext::time_is_up(void)
+{
+    if (limit_reached) {
+        return true;
+    }
+    if (deadline == Deadline::max()) {
+        return false;
+    }
+    // reading the clock takes a few dozen nanoseconds, so look at it
+    // often enough for deadlines of milliseconds but not every step
+    if (++call_counter % TIME_CHECK_INTERVAL == 0 &&
+        std::chrono::steady_clock::now() >= deadline) {
+        limit_reached = true;
+    }
+    return limit_reached;
 }
 
-void Speller::set_limiting_behaviour(int nbest, Weight maxweight, Weight beam)
+void SearchContext::set_limiting_behaviour(int nbest, Weight maxweight, Weight beam)
 {
     limiting = None;
     limit = std::numeric_limits<Weight>::max();
@@ -1040,20 +2407,20 @@ void Speller::set_limiting_behaviour(int nbest, Weight maxweight, Weight beam)
     }
 }
 
-void Speller::adjust_weight_limits(int nbest, Weight beam)
+void SearchContext::adjust_weight_limits(int nbest, Weight beam)
 {
     if (limiting == MaxWeight) {
         return;
     } else if (limiting == Nbest && nbest_queue.size() >= nbest) {
         limit = nbest_queue.get_highest();
     } else if (limiting == MaxWeightNbest && nbest_queue.size() >= nbest) {
-        limit = std::min(limit, nbest_queue.get_lowest());
+        limit = std::min(limit, nbest_queue.get_highest());
     } else if (limiting == Beam && best_suggestion < std::numeric_limits<Weight>::max()) {
         limit = best_suggestion + beam;
     } else if (limiting == NbestBeam) {
         if (best_suggestion < std::numeric_limits<Weight>::max()) {
             if (nbest_queue.size() >= nbest) {
-                limit = std::min(best_suggestion + beam, nbest_queue.get_lowest());
+                limit = std::min(best_suggestion + beam, nbest_queue.get_highest());
             } else {
                 limit = best_suggestion + beam;
             }
@@ -1067,19 +2434,35 @@ void Speller::adjust_weight_limits(int nbest, Weight beam)
             limit = std::min(limit, best_suggestion + beam);
         }
         if (nbest_queue.size() >= nbest) {
-            limit = std::min(limit, nbest_queue.get_lowest());
+            limit = std::min(limit, nbest_queue.get_highest());
         }
     }
 }
 
-bool Speller::check(char * line)
+bool SearchContext::check(char * line)
+{
+    std::shared_ptr<const KnownForms> known =
+        std::atomic_load(&speller->known_forms);
+    switch (known ? known->find(line) : KnownForms::Unknown) {
+    case KnownForms::Accepted:
+        return true;
+    case KnownForms::Rejected:
+        return false;
+    default:
+        return accepts(line);
+    }
+}
+
+bool SearchContext::accepts(char * line)
 {
     mode = Check;
     if (!init_input(line)) {
         return false;
     }
-    TreeNode start_node(FlagDiacriticState(get_state_size(), 0));
+    TreeNode start_node(NEUTRAL_FLAG_STATE);
     queue.assign(1, start_node);
+    paths.clear();
+    flag_states.clear();
     limit = std::numeric_limits<Weight>::max();
 
     while (queue.size() > 0) {
@@ -1107,6 +2490,15 @@ std::string stringify(KeyTable * key_table,
     return s;
 }
 
+std::string stringify(KeyTable * key_table,
+                      const PathArena & paths,
+                      PathIndex path)
+{
+    SymbolVector symbol_vector;
+    paths.symbols(path, symbol_vector);
+    return stringify(key_table, symbol_vector);
+}
+
 std::vector<std::string> symbolify(KeyTable * key_table,
                                    SymbolVector & symbol_vector)
 {
@@ -1119,6 +2511,15 @@ std::vector<std::string> symbolify(KeyTable * key_table,
     return s;
 }
 
+std::vector<std::string> symbolify(KeyTable * key_table,
+                                   const PathArena & paths,
+                                   PathIndex path)
+{
+    SymbolVector symbol_vector;
+    paths.symbols(path, symbol_vector);
+    return symbolify(key_table, symbol_vector);
+}
+
 void Speller::build_alphabet_translator(void)
 {
     TransducerAlphabet * from = mutator->get_alphabet();
@@ -1145,7 +2546,7 @@ void Speller::build_alphabet_translator(void)
     }
 }
 
-bool Speller::init_input(char * line)
+bool SearchContext::init_input(char * line)
 {
     // Initialize the symbol vector to the tokenization given by encoder.
     // In the case of tokenization failure, valid utf-8 characters
@@ -1153,6 +2554,11 @@ bool Speller::init_input(char * line)
     // such a character onwards. The empty string is tokenized as an
     // empty vector; there is no end marker.
     input.clear();
+    // forget the unknown symbols of the previous input
+    lexicon_keys.resize(lexicon->get_key_table()->size());
+    alphabet_translator.resize(speller->alphabet_translator.size());
+    lexicon_unknowns.clear();
+    mutator_unknowns.clear();
     SymbolNumber k = NO_SYMBOL;
     char ** inpointer = &line;
     char * oldpointer;
@@ -1169,30 +2575,10 @@ bool Speller::init_input(char * line)
             if (bytes_to_tokenize == 0) {
                 return false; // can't parse utf-8 character, admit failure
             } else {
-                char new_symbol[5]; // max size plus NUL
-                memcpy(new_symbol, oldpointer, bytes_to_tokenize);
-                new_symbol[bytes_to_tokenize] = '\0';
-                std::string new_symbol_string(new_symbol);
+                std::string new_symbol_string(oldpointer, bytes_to_tokenize);
                 oldpointer += bytes_to_tokenize;
                 *inpointer = oldpointer;
-                cache.push_back(CacheContainer());
-                if (!lexicon->get_alphabet()->has_string(new_symbol_string)) {
-                    lexicon->get_alphabet()->add_symbol(new_symbol_string);
-                }
-                SymbolNumber k_lexicon = lexicon->get_alphabet()->get_string_to_symbol()
-                    ->operator[](new_symbol_string);
-                lexicon->get_encoder()->read_input_symbol(new_symbol, k_lexicon);
-                if (mutator != NULL) {
-                    if (!mutator->get_alphabet()->has_string(new_symbol_string)) {
-                        mutator->get_alphabet()->add_symbol(new_symbol_string);
-                    }
-                    k = mutator->get_alphabet()->get_string_to_symbol()->
-                        operator[](new_symbol_string);
-                    mutator->get_encoder()->read_input_symbol(new_symbol, k);
-                    if (k >= alphabet_translator.size()) {
-                        add_symbol_to_alphabet_translator(k_lexicon);
-                    }
-                }
+                k = add_unknown_symbol(new_symbol_string);
                 input.push_back(k);
                 continue;
             }
@@ -1203,9 +2589,43 @@ bool Speller::init_input(char * line)
     return true;
 }
 
-void Speller::add_symbol_to_alphabet_translator(SymbolNumber to_sym)
+SymbolNumber SearchContext::add_unknown_symbol(const std::string & symbol)
 {
-    alphabet_translator.push_back(to_sym);
+    // The automata are shared, so new symbols only go to our own copies
+    // of the key table and alphabet translator, numbered after theirs
+    // until init_input() cuts the copies back
+    const StringSymbolMap * lexicon_symbols =
+        lexicon->get_alphabet()->get_string_to_symbol();
+    SymbolNumber k_lexicon;
+    if (lexicon_symbols->count(symbol) == 1) {
+        k_lexicon = lexicon_symbols->find(symbol)->second;
+    } else if (lexicon_unknowns.count(symbol) == 1) {
+        k_lexicon = lexicon_unknowns[symbol];
+    } else {
+        k_lexicon = static_cast<SymbolNumber>(lexicon_keys.size());
+        lexicon_keys.push_back(symbol);
+        lexicon_unknowns[symbol] = k_lexicon;
+    }
+    if (mutator == NULL || mode == Check) {
+        // input was tokenized with the language model's alphabet
+        return k_lexicon;
+    }
+    const StringSymbolMap * mutator_symbols =
+        mutator->get_alphabet()->get_string_to_symbol();
+    SymbolNumber k;
+    if (mutator_symbols->count(symbol) == 1) {
+        k = mutator_symbols->find(symbol)->second;
+    } else if (mutator_unknowns.count(symbol) == 1) {
+        k = mutator_unknowns[symbol];
+    } else {
+        k = static_cast<SymbolNumber>(mutator->get_key_table()->size() +
+                                      mutator_unknowns.size());
+        mutator_unknowns[symbol] = k;
+    }
+    if (k >= alphabet_translator.size()) {
+        alphabet_translator.push_back(k_lexicon);
+    }
+    return k;
 }
 
 } // namespace hfst_ospell
@@ -19,11 +19,17 @@
 #include "hfstol-stdafx.h"
 #include <string>
 #include <deque>
-#include <queue>
 #include <list>
+#include <memory>
+#include <set>
+#include <queue>
+#include <algorithm>
+#include <unordered_map>
 #include <stdexcept>
 #include <limits>
-#include <ctime>
+#include <chrono>
+#include <atomic>
+#include <mutex>
 #include "hfst-ol.h"
 
 namespace hfst_ospell
@@ -41,6 +47,8 @@ namespace hfst_ospell
 		StringPairWeightPair;
 	typedef std::vector<TreeNode> TreeNodeVector;
 	typedef std::map<std::string, Weight> StringWeightMap;
+	// a point in wall clock time to stop searching at
+	typedef std::chrono::steady_clock::time_point Deadline;
 
 	// Contains low-level processing stuff.
 	struct STransition
@@ -187,10 +195,22 @@ namespace hfst_ospell
 								SymbolsWeightComparison>
 		AnalysisSymbolsQueue;
 
-	struct WeightQueue : public std::list<Weight>
+	// The n best weights seen so far, as a max-heap in storage that is
+	// kept between queries. With a capacity, pushing to a full queue
+	// drops the biggest weight, so it never holds more than that.
+	class WeightQueue
 	{
-		void push(Weight w); // add a new weight
-		void pop(void);		 // delete the biggest weight
+		std::vector<Weight> heap; //< biggest weight first
+		size_t capacity;		  //< most weights to keep, 0 for no limit
+		Weight lowest;			  //< smallest weight in heap
+
+	public:
+		WeightQueue(void);
+		void reset(size_t capacity); // empty and set capacity
+		void push(Weight w);		 // add a new weight
+		void replace(Weight old_weight, Weight w); // lower a weight pushed before
+		void pop(void);				 // delete the biggest weight
+		size_t size(void) const;
 		Weight get_lowest(void) const;
 		Weight get_highest(void) const;
 	};
@@ -208,6 +228,11 @@ namespace hfst_ospell
 
 		static const TransitionTableIndex START_INDEX = 0; //< position of first
 
+		//
+		// read transducer from @a raw, checking the tables against
+		// @a raw_end
+		Transducer(char *raw, const char *raw_end);
+
 	public:
 		//
 		// read transducer from file @a f
@@ -215,6 +240,16 @@ namespace hfst_ospell
 		//
 		// read transducer from raw dara @a data
 		Transducer(char *raw);
+		//
+		// read transducer from the @a length bytes at @a raw, checking
+		// the tables against their end
+		Transducer(char *raw, size_t length);
+		//
+		// use transducer from ospell @a image, which has to outlive it
+		Transducer(ImageReader &image);
+		//
+		// append transducer to ospell image @a blob
+		void write(std::string &blob);
 		IndexTable indices;			 //< index table
 		TransitionTable transitions; //< transition table
 		//
@@ -251,7 +286,7 @@ namespace hfst_ospell
 		TransducerAlphabet *get_alphabet(void);
 		//
 		// get flag stuff of automaton
-		OperationMap *get_operations(void);
+		const OperationTable *get_operations(void) const;
 		//
 		// follow epsilon transitions from index
 		STransition take_epsilons(const TransitionTableIndex i) const;
@@ -263,6 +298,16 @@ namespace hfst_ospell
 		STransition take_non_epsilons(const TransitionTableIndex i,
 									  const SymbolNumber symbol) const;
 		//
+		// the transition at @a i
+		STransition take_transition(const TransitionTableIndex i) const;
+		//
+		// end of the run of transitions from @a i with input @a symbol
+		TransitionTableIndex run_end(const TransitionTableIndex i,
+									 const SymbolNumber symbol) const;
+		//
+		// end of the run of epsilon and flag transitions from @a i
+		TransitionTableIndex epsilon_run_end(const TransitionTableIndex i);
+		//
 		// get next index
 		TransitionTableIndex next(const TransitionTableIndex i,
 								  const SymbolNumber symbol) const;
@@ -287,33 +332,239 @@ namespace hfst_ospell
 		Weight final_weight(const TransitionTableIndex i) const;
 		//
 		// whether it's a flag
-		bool is_flag(const SymbolNumber symbol);
+		bool is_flag(const SymbolNumber symbol) const;
 		//
 		// whether it's weighedc
 		bool is_weighted(void);
+		//
+		// number of entries in the index and transition tables
+		TransitionTableIndex index_table_size(void);
+		TransitionTableIndex target_table_size(void);
+	};
+
+	// Internal class for the remaining cost estimates of an error model.
+
+	// Holds for each state of the error model the least weight it takes
+	// from there to a final state while consuming exactly r more input
+	// symbols, with every r of at least MAX_REMAINING sharing the least
+	// weight of consuming at least that many. As long as no weight is
+	// negative, a search node can't end up cheaper than its weight plus
+	// this, so nodes over the limit with it can be dropped early.
+	class RemainingCostTable
+	{
+		std::vector<uint32_t> rows;	 //< row of each state, by table position
+		std::vector<Weight> costs;	 //< MAX_REMAINING + 1 costs per row
+		TransitionTableIndex index_table_size;
+
+		// row of @a state, or NO_ROW if it was never reached
+		uint32_t row(TransitionTableIndex state) const;
+
+	public:
+		static const unsigned int MAX_REMAINING = 8;
+		static const uint32_t NO_ROW = UINT32_MAX;
+
+		RemainingCostTable(void);
+		//
+		// compute the costs of @a mutator, or leave the table empty if
+		// it has negative weights
+		void build(Transducer &mutator);
+		//
+		// append the costs to ospell image @a blob, or read them back
+		void write(std::string &blob) const;
+		void read(ImageReader &image);
+		//
+		// whether there are no estimates to use
+		bool empty(void) const;
+		//
+		// least weight from @a state to a final state consuming
+		// @a remaining more input; infinite if there's no way at all
+		Weight get(TransitionTableIndex state, unsigned int remaining) const;
+	};
+
+	// Internal class for checking forms without searching.
+
+	// An open addressing hash table of word forms whose check() verdict
+	// is known, accepted or not. Each slot holds the form itself rather
+	// than a pointer to it, and slots are laid out two to a cache line,
+	// so a form in the table is usually found by reading one line. Forms
+	// longer than MAX_LENGTH bytes aren't kept. Once filled the table is
+	// only read, so it can be shared by any number of threads.
+	class KnownForms
+	{
+	public:
+		static const size_t MAX_LENGTH = 30;
+		enum Verdict
+		{
+			Unknown,
+			Accepted,
+			Rejected
+		};
+
+		KnownForms(void);
+		//
+		// forget all forms and make room for @a forms of them
+		void reset(size_t forms);
+		//
+		// remember the verdict on @a form of @a length bytes, returning
+		// false if it is too long or there is no room
+		bool add(const char *form, size_t length, bool accepted);
+		//
+		// the verdict on NUL-terminated @a form, if it is known
+		Verdict find(const char *form) const;
+		//
+		// whether there are no forms to look up
+		bool empty(void) const;
+
+	private:
+		struct Slot
+		{
+			uint8_t length;	 //< length of form, 0 for an empty slot
+			uint8_t verdict; //< a Verdict
+			char form[MAX_LENGTH];
+		};
+		std::vector<char> storage; //< room for the slots and alignment
+		Slot *slots;			   //< first slot, on a cache line boundary
+		size_t mask;			   //< number of slots less one
+		size_t count;			   //< number of forms
+
+		static size_t hash(const char *form, size_t length);
+	};
+
+	typedef uint32_t PathIndex;
+	// the empty output string
+	const PathIndex EMPTY_PATH = UINT32_MAX;
+
+	// Internal class for output string storage.
+
+	// The output strings of search nodes are stored as back-pointers into
+	// an arena: each entry holds the last symbol of a string and the index
+	// of the entry for the rest of it. Strings share their prefixes, so
+	// extending one is O(1) and never copies. An arena can be layered on
+	// top of a read-only base arena, whose entries it then extends.
+	class PathArena
+	{
+		struct PathNode
+		{
+			PathIndex parent;	 //< rest of the string
+			SymbolNumber symbol; //< last symbol of the string
+		};
+		std::vector<PathNode> nodes;
+		const PathArena *base; //< arena of the lower indices, or NULL
+		PathIndex base_size;   //< number of indices in base
+
+	public:
+		PathArena(void) : base(NULL), base_size(0)
+		{
+		}
+		//
+		// forget all strings, continuing from @a new_base if given
+		void clear(const PathArena *new_base = NULL);
+		//
+		// string of @a path followed by @a symbol, or @a path for epsilon
+		PathIndex extend(PathIndex path, SymbolNumber symbol);
+		//
+		// symbols of @a path in order
+		void symbols(PathIndex path, SymbolVector &symbol_vector) const;
+		//
+		// number of indices in use, including the base
+		PathIndex size(void) const;
+		//
+		// approximate bytes taken by the strings, not counting the base
+		size_t memory_size(void) const;
+		//
+		// append the strings of an arena without a base to @a blob
+		void write(std::string &blob) const;
+		//
+		// replace the strings with those written at @a *raw, before
+		// @a end, and move past them; false if they don't make sense
+		bool read(const char **raw, const char *end);
 	};
 
+	typedef uint32_t FlagStateHandle;
+	// the state with all features unset
+	const FlagStateHandle NEUTRAL_FLAG_STATE = 0;
+	// the result of an incompatible flag diacritic
+	const FlagStateHandle NO_FLAG_STATE = UINT32_MAX;
+
+	// Internal class for flag diacritic processing.
+
+	// Flag diacritic states are interned, so that a search node only holds
+	// a handle to its state and equal states are stored once. The results
+	// of applying flag diacritics to states are memoized, so checking a
+	// flag arc is a table lookup once the combination has been seen. Like
+	// a PathArena, a pool can be layered on top of a read-only base pool,
+	// whose states and results it then shares.
+	class FlagStatePool
+	{
+		SymbolNumber state_size;		  //< number of features
+		const OperationTable *operations; //< flag diacritics by symbol
+		std::vector<ValueNumber> values;  //< state_size values per handle
+		std::unordered_map<std::string, FlagStateHandle> handles;
+		std::unordered_map<uint64_t, FlagStateHandle> results;
+		FlagDiacriticState scratch;		  //< for applying operations
+		const FlagStatePool *base;		  //< pool of the lower handles, or NULL
+		FlagStateHandle base_size;		  //< number of handles in base
+
+		FlagStateHandle intern(const FlagDiacriticState &state);
+
+	public:
+		//
+		// create an unusable pool, to be assigned to
+		FlagStatePool(void);
+		//
+		// create pool for states of @a state_size features, changed
+		// by the flag diacritics in @a operations
+		FlagStatePool(SymbolNumber state_size,
+					  const OperationTable *operations);
+		//
+		// forget all states, continuing from @a new_base if given
+		void clear(const FlagStatePool *new_base = NULL);
+		//
+		// state after flag diacritic @a flag_symbol in state @a state,
+		// or NO_FLAG_STATE if they are incompatible
+		FlagStateHandle apply(FlagStateHandle state, SymbolNumber flag_symbol);
+		//
+		// number of distinct states seen, including the base
+		size_t size(void) const;
+		//
+		// approximate bytes taken by the states and results, not
+		// counting the base
+		size_t memory_size(void) const;
+		//
+		// append the states of a pool without a base to @a blob
+		void write(std::string &blob) const;
+		//
+		// replace the states with those written at @a *raw, before
+		// @a end, and move past them; false if they don't make sense
+		bool read(const char **raw, const char *end);
+	};
+
+	//
+	// apply @a op to flag @a state, returning whether they are compatible
+	bool apply_flag_operation(FlagDiacriticState &state,
+							  const FlagDiacriticOperation &op);
+
 	// Internal class for alphabet processing.
 
 	// Contains low-level processing stuff.
 	struct TreeNode
 	{
 		//    SymbolVector input_string; //<! the current input vector
-		SymbolVector string;				//< the current output vector
+		PathIndex output;					//< the current output string
 		unsigned int input_state;			//< its input state
 		TransitionTableIndex mutator_state; //< state in error model
 		TransitionTableIndex lexicon_state; //< state in language model
-		FlagDiacriticState flag_state;		//< state of flags
+		FlagStateHandle flag_state;			//< state of flags
 		Weight weight;						//< weight
 
 		//
 		// construct a node in trie from all that stuff
-		TreeNode(SymbolVector prev_string,
+		TreeNode(PathIndex prev_output,
 				 unsigned int i,
 				 TransitionTableIndex mutator,
 				 TransitionTableIndex lexicon,
-				 FlagDiacriticState state,
-				 Weight w) : string(prev_string),
+				 FlagStateHandle state,
+				 Weight w) : output(prev_output),
 							 input_state(i),
 							 mutator_state(mutator),
 							 lexicon_state(lexicon),
@@ -324,8 +575,8 @@ namespace hfst_ospell
 
 		//
 		// construct empty node with a starting state for flags
-		TreeNode(FlagDiacriticState start_state) : // starting state node
-												   string(SymbolVector()),
+		TreeNode(FlagStateHandle start_state) : // starting state node
+												   output(EMPTY_PATH),
 												   input_state(0),
 												   mutator_state(0),
 												   lexicon_state(0),
@@ -335,12 +586,14 @@ namespace hfst_ospell
 		}
 
 		//
-		// check if tree node is compatible with flag diacritc
-		bool try_compatible_with(FlagDiacriticOperation op);
+		// check if tree node is compatible with flag diacritc @a flag_symbol,
+		// moving to the resulting flag state in @a flags if it is
+		bool try_compatible_with(FlagStatePool &flags, SymbolNumber flag_symbol);
 
 		//
-		// traverse some node in lexicon
-		TreeNode update_lexicon(SymbolNumber next_symbol,
+		// traverse some node in lexicon, output strings go to @a paths
+		TreeNode update_lexicon(PathArena &paths,
+								SymbolNumber next_symbol,
 								TransitionTableIndex next_lexicon,
 								Weight weight);
 
@@ -351,13 +604,15 @@ namespace hfst_ospell
 
 		//
 		// The update functions return updated copies of this state
-		TreeNode update(SymbolNumber output_symbol,
+		TreeNode update(PathArena &paths,
+						SymbolNumber output_symbol,
 						unsigned int next_input,
 						TransitionTableIndex next_mutator,
 						TransitionTableIndex next_lexicon,
 						Weight weight);
 
-		TreeNode update(SymbolNumber output_symbol,
+		TreeNode update(PathArena &paths,
+						SymbolNumber output_symbol,
 						TransitionTableIndex next_mutator,
 						TransitionTableIndex next_lexicon,
 						Weight weight);
@@ -365,6 +620,82 @@ namespace hfst_ospell
 
 	typedef std::vector<TreeNode> TreeNodeQueue;
 
+	struct CacheContainer
+	{
+		// All the nodes that ultimately result from searching at input depth 1
+		TreeNodeVector nodes;
+		// The output strings of the nodes
+		PathArena paths;
+		// The flag states of the nodes
+		FlagStatePool flag_states;
+		// The results are for length max one inputs only
+		StringWeightVector results_len_0;
+		StringWeightVector results_len_1;
+		bool empty;
+		// the entry whose output strings ours continue, kept alive for
+		// them, or NULL if there is none or it lives in Speller::cache
+		std::shared_ptr<const CacheContainer> parent;
+		// approximate bytes taken by the entry, not counting its parent
+		size_t bytes;
+
+		CacheContainer(void) : empty(true), bytes(0) {}
+
+		void clear(void)
+		{
+			nodes.clear();
+			paths.clear();
+			flag_states = FlagStatePool();
+			results_len_0.clear();
+			results_len_1.clear();
+			parent.reset();
+			bytes = 0;
+		}
+	};
+
+	// Internal class for caching the search below input prefixes.
+
+	// Holds CacheContainers of the nodes that result from searching
+	// at input depth 2 and more, keyed by the input symbols leading
+	// there, as long as they fit in a budget of bytes. The least recently
+	// used entries make way for new ones. An entry continues the output
+	// strings of the entry one symbol shorter, so the entries form a trie
+	// under the first-symbol cache of the Speller. Searches hold on to the
+	// entries they use, so an entry dropped meanwhile stays valid for
+	// them, and so does its parent.
+	class PrefixCache
+	{
+		typedef std::list<std::pair<std::string,
+									std::shared_ptr<const CacheContainer> > >
+			EntryList;
+		EntryList entries;	  //< most recently used first
+		std::unordered_map<std::string, EntryList::iterator> index;
+		size_t budget;		  //< bytes the entries may take
+		size_t bytes;		  //< bytes the entries take
+		mutable std::mutex mutex;
+
+		// drop least recently used entries over the budget
+		void trim(void);
+
+	public:
+		PrefixCache(void) : budget(0), bytes(0) {}
+		//
+		// keep entries of at most @a new_budget bytes in all; 0 keeps none
+		void set_budget(size_t new_budget);
+		bool enabled(void) const;
+		//
+		// the entry for the symbols in @a prefix, or NULL
+		std::shared_ptr<const CacheContainer> find(const std::string &prefix);
+		//
+		// keep @a entry for the symbols in @a prefix, if it fits
+		void insert(const std::string &prefix,
+					const std::shared_ptr<const CacheContainer> &entry);
+		void clear(void);
+		//
+		// bytes the entries take
+		size_t memory_size(void) const;
+	};
+
+
 	int nByte_utf8(unsigned char c);
 
 	// Exception when speller cannot map characters of error model to language
@@ -382,27 +713,42 @@ namespace hfst_ospell
 		}
 	};
 
-	// @brief Basic spell-checking automata pair unit.
+	class Speller;
 
-	// Speller consists of two automata, one for language modeling and one for
-	// error modeling. The speller object has low-level access to the automata
-	// and convenience functions for checking, analysing and correction.
-	// @see ZHfstOspeller for high level access.
-	class Speller
+	// @brief State of one search over a Speller.
+
+	// Everything that changes while checking, correcting or analysing a
+	// string lives in a search context, so that a single Speller can be
+	// searched by as many threads as there are contexts. A context must
+	// only be used by one thread at a time. Characters that the automata
+	// don't know get symbol numbers of the context's own, which only last
+	// until the next input, so the context doesn't grow with them either.
+	class SearchContext
 	{
 	public:
+		Speller *speller;				  //< automata and cache searched
 		Transducer *mutator;			  //< error model
 		Transducer *lexicon;			  //< languag model
 		SymbolVector input;				  //< current input
 		TreeNodeQueue queue;			  //< current traversal fifo stack
+		PathArena paths;				  //< output strings of the nodes
+		FlagStatePool flag_states;		  //< flag states of the nodes
 		TreeNode next_node;				  //< current next node
 		Weight limit;					  //< current limit for weights
 		Weight best_suggestion;			  //< best suggestion so far
 		WeightQueue nbest_queue;		  //< queue to keep track of current n best results
-		SymbolVector alphabet_translator; //< alphabets in automata
-		OperationMap *operations;		  //< flags in it
-		//< A cache for the result of first symbols
-		std::vector<CacheContainer> cache;
+		SymbolVector alphabet_translator; //< alphabets in automata, and input's
+		KeyTable lexicon_keys;			  //< language model symbols, and input's
+		StringSymbolMap lexicon_unknowns; //< input's language model symbols
+		StringSymbolMap mutator_unknowns; //< input's error model symbols
+		const OperationTable *operations; //< flags in it
+		//< cache entry for a first symbol of the input's own
+		CacheContainer unknown_cache;
+		//< prefix cache entry the search started from, held while in use
+		std::shared_ptr<const CacheContainer> prefix_entry;
+		//< input depth of the nodes the search started from, whose
+		// epsilons were followed when they were cached
+		unsigned int cached_depth;
 		//< what kind of limiting behaviour we have
 		enum LimitingBehaviour
 		{
@@ -422,30 +768,49 @@ namespace hfst_ospell
 			Correct,
 			Lookup
 		} mode;
+		// in what order correct() explores the search space
+		enum SearchOrder
+		{
+			DepthFirst,
+			BestFirst
+		} search_order;
+		// whether build_cache() is running, and must not prune by
+		// remaining_cost() since the cache outlives the current input
+		bool caching;
 
-		// the maximum amount of time to take
-		double max_time;
-		// when we started work
-		clock_t start_clock;
+		// when correct() stops searching, or Deadline::max() for never
+		Deadline deadline;
 		// A counter to avoid checking the clock too often
-		unsigned long call_counter;
-		// A flag to set for when time has been overstepped
+		unsigned int call_counter;
+		// A flag to set for when time has been overstepped, so that the
+		// corrections correct() gave are only the best found in time
 		bool limit_reached;
+		// how many threads a DepthFirst correct() may split its search
+		// over, once the input is at least parallel_min_length long
+		unsigned int parallel_threads;
+		unsigned int parallel_min_length;
+		// limit shared by the contexts of a split search, or NULL
+		std::atomic<Weight> *shared_limit;
+		// corrections found by next_correction() but not yet known to be
+		// the cheapest remaining ones
+		CorrectionQueue pending;
+		// corrections handed out, only the first (cheapest) one counts
+		std::set<std::string> handed_out;
+		// the nbest and beam of start_correcting()
+		int best_first_nbest;
+		Weight best_first_beam;
 
 		//
-		// Create a speller object form error model and language automata.
-		Speller(Transducer *mutator_ptr, Transducer *lexicon_ptr);
-		//
-		// size of states
-		SymbolNumber get_state_size(void);
-		//
-		// initialise string conversions
-		void build_alphabet_translator(void);
-		void add_symbol_to_alphabet_translator(SymbolNumber to_sym);
+		// Create a search context for @a speller.
+		SearchContext(Speller *speller);
 		//
 		// initialize input string
 		bool init_input(char *line);
 		//
+		// symbol number for a character @a symbol the automata don't know,
+		// valid until the next init_input()
+		SymbolNumber add_unknown_symbol(const std::string &symbol);
+		//
 		// travers epsilons in language model
 		void lexicon_epsilons(void);
 		bool has_lexicon_epsilons(void) const
@@ -471,16 +836,73 @@ namespace hfst_ospell
 								int input_increment = 0);
 		// @brief Check if the given string is accepted by the speller
 		//
-		// foo
+		// Forms in the speller's known_forms are answered from there.
 		bool check(char *line);
+		// @brief Check by searching whether @a line is accepted
+		bool accepts(char *line);
 		// @brief suggest corrections for given string @a line.
 		//
 		// The number of corrections given and stored at any given time
-		// is limited by @a nbest if ≥ 0.
+		// is limited by @a nbest if ≥ 0. If @a time_cutoff seconds
+		// is > 0, searching stops when that much wall clock time has
+		// passed, as with correct_until().
 		CorrectionQueue correct(char *line, int nbest = 0,
 								Weight maxweight = -1.0,
 								Weight beam = -1.0,
 								float time_cutoff = 0.0);
+		// @brief suggest corrections for given string @a line, found
+		// before @a deadline.
+		//
+		// When the deadline passes, the search stops and the best
+		// corrections found so far are given, with limit_reached set.
+		CorrectionQueue correct_until(char *line, Deadline deadline,
+									  int nbest = 0,
+									  Weight maxweight = -1.0,
+									  Weight beam = -1.0);
+		// @brief start a BestFirst search for corrections of @a line,
+		// to be taken one at a time with next_correction().
+		//
+		// The limits are those of correct(). Returns false if @a line
+		// can't be tokenized, and there will be no corrections then.
+		bool start_correcting(char *line, int nbest = 0,
+							  Weight maxweight = -1.0,
+							  Weight beam = -1.0,
+							  Deadline until = Deadline::max());
+		// @brief the next correction of the input of start_correcting(),
+		// into @a correction, or false if there are no more.
+		//
+		// Expands the cheapest node first, by its weight plus heuristic(),
+		// and hands out a correction as soon as no cheaper one can remain,
+		// so the first ones come long before the search space is
+		// exhausted. They are in order of weight as long as no weights
+		// are negative. This is the BestFirst search of correct().
+		bool next_correction(StringWeightPair &correction);
+		// @brief the DepthFirst search of correct(), adding the
+		// corrections reachable from the nodes in queue to @a corrections
+		void correct_depth_first(int nbest, Weight beam,
+								 StringWeightMap &corrections);
+		// @brief correct_depth_first() split over parallel_threads contexts.
+		//
+		// The contexts take the nodes of @a first_cache one at a time and
+		// search below them, pruning with the lowest limit any of them
+		// has reached. Their corrections are merged into @a corrections.
+		void correct_parallel(int nbest, Weight beam,
+							  const CacheContainer &first_cache,
+							  StringWeightMap &corrections);
+		// @brief take over the input and limits of @a owner, to help it
+		// search below the nodes of @a first_cache
+		void share_query(const SearchContext &owner,
+						 const CacheContainer &first_cache);
+		// @brief admissible lower bound for the weight @a node still
+		// has to gather to become a correction
+		Weight heuristic(const TreeNode &node) const;
+		// @brief lower bound for the error model weight of a node in
+		// @a mutator_state having consumed @a input_state symbols of
+		// input; 0 when not correcting
+		Weight remaining_cost(TransitionTableIndex mutator_state,
+							  unsigned int input_state) const;
+		// whether the deadline of correct_until() has passed
+		bool time_is_up(void);
 
 		bool is_under_weight_limit(Weight w) const;
 		void set_limiting_behaviour(int nbest, Weight maxweight, Weight beam);
@@ -499,35 +921,146 @@ namespace hfst_ospell
 		// strings.
 		AnalysisSymbolsQueue analyseSymbols(char *line, int nbest = 0);
 
-		void build_cache(SymbolNumber first_sym);
-		// @brief Construct a cache entry for @a first_sym..
+		// @brief the cache entry for @a first_sym, built if need be.
+		CacheContainer &get_cache(SymbolNumber first_sym);
+		// @brief Construct the cache entry @a entry for @a first_sym,
+		// the first symbol of the input.
+		//
+		// Doesn't depend on the limits of any search; those are set
+		// up after caching.
+		void build_cache(SymbolNumber first_sym, CacheContainer &entry);
+		// @brief the entry of the prefix cache to search the input from,
+		// built if need be, or @a first_cache, the entry of its first
+		// symbol, if there is no deeper one to use.
+		//
+		// Sets cached_depth to the depth of the entry, and keeps it alive
+		// in prefix_entry.
+		const CacheContainer &get_prefix_cache(
+			const CacheContainer &first_cache);
+		// @brief Construct the prefix cache entry @a entry for the input
+		// one symbol deeper than @a parent, continuing from its nodes.
+		void build_prefix_cache(const CacheContainer &parent,
+								CacheContainer &entry);
 	};
 
-	struct CacheContainer
-	{
-		// All the nodes that ultimately result from searching at input depth 1
-		TreeNodeVector nodes;
-		// The results are for length max one inputs only
-		StringWeightVector results_len_0;
-		StringWeightVector results_len_1;
-		bool empty;
+	// @brief Basic spell-checking automata pair unit.
 
-		CacheContainer(void) : empty(true) {}
+	// Speller consists of two automata, one for language modeling and one for
+	// error modeling. The speller object has low-level access to the automata
+	// and convenience functions for checking, analysing and correction.
+	// Once constructed it is only read, apart from the first-symbol cache
+	// that fills up on first use of each symbol, or all at once with
+	// build_all_caches() or read_cache(), and the prefix cache that guards
+	// itself, so it can be shared by any number of SearchContexts and
+	// threads.
+	// @see ZHfstOspeller for high level access.
+	class Speller
+	{
+	public:
+		Transducer *mutator;			  //< error model
+		Transducer *lexicon;			  //< languag model
+		SymbolVector alphabet_translator; //< alphabets in automata
+		const OperationTable *operations; //< flags in it
+		//< A cache for the result of first symbols
+		std::vector<CacheContainer> cache;
+		//< whether each entry of cache has been built
+		std::vector<std::once_flag> cache_built;
+		// how many input symbols deep the prefix cache goes; 1 leaves it
+		// to the first-symbol cache
+		std::atomic<unsigned int> prefix_depth;
+		// cache of the search below longer input prefixes
+		PrefixCache prefix_cache;
+		// lower bounds for the error model weight still to come
+		RemainingCostTable remaining_costs;
+		// forms check() knows the verdict on without searching, or NULL;
+		// replaced whole with atomic_store() and read with atomic_load()
+		std::shared_ptr<const KnownForms> known_forms;
+		// search contexts not in use
+		std::vector<SearchContext *> idle_contexts;
+		std::mutex contexts_mutex;
 
-		void clear(void)
-		{
-			nodes.clear();
-			results_len_0.clear();
-			results_len_1.clear();
-		}
+		//
+		// Create a speller object form error model and language automata.
+		Speller(Transducer *mutator_ptr, Transducer *lexicon_ptr);
+		//
+		// Create it from automata read from ospell @a image, reading what
+		// write_image() wrote after them instead of building it
+		Speller(Transducer *mutator_ptr, Transducer *lexicon_ptr,
+				ImageReader &image);
+		~Speller(void);
+		//
+		// size of states
+		SymbolNumber get_state_size(void);
+		//
+		// initialise string conversions
+		void build_alphabet_translator(void);
+		//
+		// get a search context of this speller for the calling thread,
+		// until it's given back with release_context()
+		SearchContext *acquire_context(void);
+		void release_context(SearchContext *context);
+		//
+		// find out which of @a forms are accepted, so that check() can
+		// answer for them without searching; returns how many were kept.
+		// Other threads may check meanwhile, with the earlier forms until
+		// the new ones are ready.
+		size_t set_known_forms(const std::vector<std::string> &forms);
+		//
+		// the first-symbol cache entry for @a first_sym, built in a
+		// search context of its own if it isn't yet
+		CacheContainer &get_cache(SymbolNumber first_sym);
+		//
+		// build the first-symbol cache entries of all symbols that aren't
+		// yet, stopping early if @a stop turns true
+		void build_all_caches(const std::atomic<bool> *stop = NULL);
+		//
+		// append all first-symbol cache entries to @a blob, building
+		// those that aren't yet. The blob is only good for these automata
+		// on machines of the same byte order.
+		void write_cache(std::string &blob);
+		//
+		// append what's built from the automata when the speller is
+		// created to ospell image @a blob, after the automata
+		void write_image(std::string &blob) const;
+		//
+		// take the first-symbol cache entries that aren't built yet from
+		// the @a length bytes of @a data written by write_cache(); false,
+		// leaving the cache as it was, if they aren't for these automata
+		bool read_cache(const char *data, size_t length);
+		//
+		// cache the search below the first @a depth symbols of inputs,
+		// in at most @a budget bytes besides the first-symbol cache.
+		// Other threads may search meanwhile.
+		void set_prefix_cache(unsigned int depth, size_t budget);
+		//
+		// convenience versions of the SearchContext functions, each
+		// searching in a context of its own
+		bool check(char *line);
+		CorrectionQueue correct(char *line, int nbest = 0,
+								Weight maxweight = -1.0,
+								Weight beam = -1.0,
+								float time_cutoff = 0.0);
+		AnalysisQueue analyse(char *line, int nbest = 0);
+		AnalysisSymbolsQueue analyseSymbols(char *line, int nbest = 0);
 	};
 
+	// the deadline @a seconds from now, or none if that is not > 0
+	Deadline deadline_in(double seconds);
+
 	std::string stringify(KeyTable *key_table,
 						  SymbolVector &symbol_vector);
 
+	std::string stringify(KeyTable *key_table,
+						  const PathArena &paths,
+						  PathIndex path);
+
 	std::vector<std::string> symbolify(KeyTable *key_table,
 									   SymbolVector &symbol_vector);
 
+	std::vector<std::string> symbolify(KeyTable *key_table,
+									   const PathArena &paths,
+									   PathIndex path);
+
 } // namespace hfst_ospell
 
 // Some platforms lack strndup
@@ -0,0 +1,78 @@
+"""Fill a suggestion store with the corrections of frequent misspellings.
+
+Usage:
+
+    python -m py_hfst_ospell.populate_store ARCHIVE STORE FREQLIST
+    python -m py_hfst_ospell.populate_store LEXICON ERRMODEL STORE FREQLIST
+
+ARCHIVE is a zhfst archive or an ospell image, LEXICON and ERRMODEL are
+automata. The store is tied to the files given, so give the ones the
+spellers using it are loaded from.
+
+FREQLIST has one word form per line with its count, either as
+"count form" (like the output of uniq -c) or as "form<TAB>count".
+The misspelled ones among the most frequent forms get their corrections
+computed and appended to STORE, which spellers opened with the same
+automata read at start-up.
+"""
+import argparse
+
+from py_hfst_ospell import Speller
+
+
+def read_frequencies(path):
+    """Read (count, form) pairs from a word frequency list."""
+    frequencies = []
+    with open(path, encoding='utf-8') as lines:
+        for line in lines:
+            line = line.rstrip('\n')
+            if '\t' in line:
+                form, _, count = line.rpartition('\t')
+            else:
+                count, _, form = line.strip().partition(' ')
+            try:
+                frequencies.append((int(count), form.strip()))
+            except ValueError:
+                continue
+    return frequencies
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Store corrections of frequent misspellings.')
+    parser.add_argument('sources', nargs='+',
+                        help='zhfst archive or ospell image, or lexicon '
+                             'and error model')
+    parser.add_argument('store', help='suggestion store to fill')
+    parser.add_argument('freqlist', help='word frequency list')
+    parser.add_argument('--top', type=int, default=100000,
+                        help='number of most frequent forms to consider')
+    parser.add_argument('--queue-limit', type=int, default=0,
+                        help='as Speller.set_queue_limit()')
+    parser.add_argument('--weight-limit', type=float, default=-1.0,
+                        help='as Speller.set_weight_limit()')
+    parser.add_argument('--beam', type=float, default=-1.0,
+                        help='as Speller.set_beam()')
+    parser.add_argument('--best-first', action='store_true',
+                        help='as Speller.set_best_first()')
+    args = parser.parse_args()
+
+    if len(args.sources) > 2:
+        parser.error('give an archive, or a lexicon and an error model')
+    # stored corrections are only found with the same settings
+    speller = Speller(*args.sources)
+    speller.set_queue_limit(args.queue_limit)
+    speller.set_weight_limit(args.weight_limit)
+    speller.set_beam(args.beam)
+    speller.set_best_first(args.best_first)
+    speller.open_suggestion_store(args.store)
+
+    frequencies = read_frequencies(args.freqlist)
+    frequencies.sort(key=lambda pair: pair[0], reverse=True)
+    forms = [form for _, form in frequencies[:args.top] if form]
+    stored = speller.populate_suggestion_store(forms)
+    print('%d corrections stored in %s' % (stored, args.store))
+
+
+if __name__ == '__main__':
+    main()
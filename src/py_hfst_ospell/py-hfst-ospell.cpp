@@ -1,19 +1,62 @@
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <stdexcept>
 #include "py-hfst-ospell.h"
 
+// Read the automaton at @a path; the tables are copied out of the file,
+// so only ospell images are searched in place in their file
+static hfst_ospell::Transducer *read_transducer(const std::string& path) {
+	std::ifstream file(path, std::ios::binary);
+	std::vector<char> raw((std::istreambuf_iterator<char>(file)),
+	                      std::istreambuf_iterator<char>());
+	if (!file.eof() || raw.empty()) {
+		throw std::runtime_error("Could not read " + path);
+	}
+	return new hfst_ospell::Transducer(&raw[0], raw.size());
+}
+
 
-Speller::Speller(std::string lex_path, std::string error_path) {
-	FILE *lex_source = fopen(lex_path.c_str(), "r");
-	FILE *error_source = fopen(error_path.c_str(), "r");
+static std::vector<std::string> correction_strings(hfst_ospell::CorrectionQueue& corrections) {
+	std::vector<std::string> results;
+	while (corrections.size() > 0) {
+		results.push_back(corrections.top().first);
+		corrections.pop();
+	}
+	return results;
+}
+
+static std::vector<std::pair<std::string, float>> weighted_corrections(hfst_ospell::CorrectionQueue& corrections) {
+	std::vector<std::pair<std::string, float>> results;
+	while (corrections.size() > 0) {
+		const auto& correction = corrections.top();
+		results.emplace_back(correction.first, correction.second);
+		corrections.pop();
+	}
+	return results;
+}
 
-	lex = new hfst_ospell::Transducer(lex_source);
-	err = new hfst_ospell::Transducer(error_source);
+Speller::Speller(std::string lex_path, std::string error_path) :
+	lex_path(lex_path), error_path(error_path) {
+	lex = read_transducer(lex_path);
+	err = read_transducer(error_path);
 
 	hfst_ospell::Speller *s = new hfst_ospell::Speller(err, lex);
 
 	speller.inject_speller(s);
 }
 
+Speller::Speller(std::string path) :
+	lex(NULL), err(NULL), lex_path(path) {
+	// an ospell image is searched in place in a mapping of it
+	if (hfst_ospell::ZHfstOspeller::is_image(path)) {
+		speller.read_image(path);
+	}
+	else {
+		speller.read_zhfst(path);
+	}
+}
+
 void Speller::do_suggest(const std::string str) {
 	hfst_ospell::CorrectionQueue corrections = speller.suggest(str);
 	bool analyse = true;
@@ -105,23 +148,65 @@ bool Speller::spell(const std::string str) {
 
 std::vector<std::string> Speller::suggest(const std::string str) {
 	hfst_ospell::CorrectionQueue corrections = speller.suggest(str);
-	std::vector<std::string> results;
+	return correction_strings(corrections);
+}
 
-	while (corrections.size() > 0) {
-		const std::string& corr = corrections.top().first;
-		results.push_back(corr.c_str());
-		corrections.pop();
+std::vector<std::pair<std::string, float>> Speller::suggest_weighted(const std::string str) {
+	hfst_ospell::CorrectionQueue corrections = speller.suggest(str);
+	return weighted_corrections(corrections);
+}
+
+std::vector<std::string> Speller::suggest_within(const std::string str, double milliseconds, bool *truncated) {
+	hfst_ospell::CorrectionQueue corrections = speller.suggest(str, hfst_ospell::deadline_in(milliseconds / 1000.0), *truncated);
+	return correction_strings(corrections);
+}
+
+std::vector<std::pair<std::string, float>> Speller::suggest_weighted_within(const std::string str, double milliseconds, bool *truncated) {
+	hfst_ospell::CorrectionQueue corrections = speller.suggest(str, hfst_ospell::deadline_in(milliseconds / 1000.0), *truncated);
+	return weighted_corrections(corrections);
+}
+
+Suggestions *Speller::suggest_stream(const std::string str) {
+	return new Suggestions(speller.suggest_stream(str));
+}
+
+Suggestions::Suggestions(hfst_ospell::SuggestionStream *stream) : stream(stream) {
+}
+
+Suggestions::~Suggestions() {
+	delete stream;
+}
+
+bool Suggestions::next(std::string *correction, float *weight) {
+	hfst_ospell::StringWeightPair found;
+	if (!stream->next(found)) {
+		return false;
+	}
+	*correction = found.first;
+	*weight = found.second;
+	return true;
+}
+
+std::vector<bool> Speller::spell_batch(const std::vector<std::string>& strs) {
+	return speller.spell_batch(strs);
+}
+
+std::vector<std::vector<std::string>> Speller::suggest_batch(const std::vector<std::string>& strs) {
+	std::vector<hfst_ospell::CorrectionQueue> corrections = speller.suggest_batch(strs);
+	std::vector<std::vector<std::string>> results;
+	results.reserve(corrections.size());
+	for (auto& queue : corrections) {
+		results.push_back(correction_strings(queue));
 	}
 	return results;
 }
 
-std::vector<std::pair<std::string, float>> Speller::suggest_weighted(const std::string str) {
-	hfst_ospell::CorrectionQueue corrections = speller.suggest(str);
-	std::vector<std::pair<std::string, float>> results;
-	while (corrections.size() > 0) {
-		const auto& correction = corrections.top();
-		results.emplace_back(correction.first, correction.second);
-		corrections.pop();
+std::vector<std::vector<std::pair<std::string, float>>> Speller::suggest_weighted_batch(const std::vector<std::string>& strs) {
+	std::vector<hfst_ospell::CorrectionQueue> corrections = speller.suggest_batch(strs);
+	std::vector<std::vector<std::pair<std::string, float>>> results;
+	results.reserve(corrections.size());
+	for (auto& queue : corrections) {
+		results.push_back(weighted_corrections(queue));
 	}
 	return results;
 }
@@ -131,7 +216,8 @@ void Speller::hello() {
 }
 
 std::string Speller::lookup(std::string word){
-	hfst_ospell::AnalysisQueue aq = lex->lookup(&word[0]);
+	hfst_ospell::AnalysisQueue aq = (lex != NULL) ?
+		lex->lookup(&word[0]) : speller.analyse(word);
 	if (aq.size() > 0){
 		return aq.top().first;
 	}
@@ -150,10 +236,73 @@ void Speller::set_queue_limit(unsigned long limit){
 	speller.set_queue_limit(limit);
 }
 
+void Speller::set_best_first(bool best_first){
+	speller.set_best_first(best_first);
+}
+
+size_t Speller::set_known_forms(const std::vector<std::string>& strs){
+	return speller.set_known_forms(strs);
+}
+
+void Speller::set_cache_size(size_t suggestions){
+	speller.set_cache_size(suggestions, 0);
+}
+
+void Speller::set_prefix_cache(unsigned int depth, size_t bytes){
+	speller.set_prefix_cache(depth, bytes);
+}
+
+void Speller::prebuild_cache(bool in_background){
+	speller.prebuild_cache(in_background);
+}
+
+void Speller::save_cache(const std::string path){
+	speller.save_cache(path, automata_checksum());
+}
+
+bool Speller::load_cache(const std::string path){
+	return speller.load_cache(path, automata_checksum());
+}
+
+void Speller::save_image(const std::string path){
+	speller.save_image(path);
+}
+
+unsigned long Speller::suggestion_cache_hits(){
+	return speller.get_suggestion_cache_counters().hits;
+}
+
+unsigned long Speller::suggestion_cache_misses(){
+	return speller.get_suggestion_cache_counters().misses;
+}
+
+void Speller::set_parallel_correction(unsigned int threads, unsigned int min_length){
+	speller.set_parallel_correction(threads, min_length);
+}
+
+uint64_t Speller::automata_checksum(){
+	// stores and caches belong to this pair of automata
+	uint64_t checksum = hfst_ospell::file_checksum(lex_path);
+	if (error_path.empty()) {
+		return checksum;
+	}
+	return hfst_ospell::file_checksum(error_path, checksum);
+}
+
+void Speller::open_suggestion_store(const std::string path){
+	speller.open_suggestion_store(path, automata_checksum());
+}
+
+void Speller::close_suggestion_store(){
+	speller.close_suggestion_store();
+}
+
+size_t Speller::populate_suggestion_store(const std::vector<std::string>& strs){
+	return speller.populate_suggestion_store(strs);
+}
+
 hfst_ospell::Transducer* createTransducer(std::string lex_path) {
-	FILE *lex_source = fopen(lex_path.c_str(), "r");
-	hfst_ospell::Transducer *lex = new hfst_ospell::Transducer(lex_source);
-	return lex;
+	return read_transducer(lex_path);
 }
 
 std::vector<std::string> lookup(hfst_ospell::Transducer* tr, std::string word) {
@@ -1,24 +1,61 @@
 #include "ZHfstOspeller.h"
 #include <vector>
 
+// Corrections of one word, cheapest first, as the search finds them
+class Suggestions {
+private:
+	hfst_ospell::SuggestionStream *stream;
+	Suggestions(hfst_ospell::SuggestionStream *stream);
+	friend class Speller;
+
+public:
+	~Suggestions();
+	bool next(std::string *correction, float *weight);
+};
+
 class Speller {
 private:
 	hfst_ospell::Transducer *lex;
 	hfst_ospell::Transducer *err;
 	hfst_ospell::ZHfstOspeller speller;
+	std::string lex_path;
+	std::string error_path;
+	uint64_t automata_checksum();
     
 public:
     Speller(std::string lex_path, std::string error_path);
+    // read an ospell image or a zhfst archive
+    Speller(std::string path);
     void do_suggest(const std::string str);
     void do_spell(const std::string str);
     bool spell(const std::string str);
     std::vector<std::string> suggest(const std::string str);
 	void hello();
 	std::vector<std::pair<std::string, float>> suggest_weighted(const std::string str);
+    std::vector<std::string> suggest_within(const std::string str, double milliseconds, bool *OUTPUT);
+    std::vector<std::pair<std::string, float>> suggest_weighted_within(const std::string str, double milliseconds, bool *OUTPUT);
+    Suggestions *suggest_stream(const std::string str);
+    std::vector<bool> spell_batch(const std::vector<std::string>& strs);
+    std::vector<std::vector<std::string>> suggest_batch(const std::vector<std::string>& strs);
+    std::vector<std::vector<std::pair<std::string, float>>> suggest_weighted_batch(const std::vector<std::string>& strs);
     std::string lookup(std::string word);
     void set_beam(float beam);
     void set_weight_limit(float limit);
     void set_queue_limit(unsigned long limit);
+    void set_best_first(bool best_first);
+    size_t set_known_forms(const std::vector<std::string>& strs);
+    void set_cache_size(size_t suggestions);
+    void set_prefix_cache(unsigned int depth, size_t bytes);
+    void prebuild_cache(bool in_background);
+    void save_cache(const std::string path);
+    bool load_cache(const std::string path);
+    void save_image(const std::string path);
+    unsigned long suggestion_cache_hits();
+    unsigned long suggestion_cache_misses();
+    void set_parallel_correction(unsigned int threads, unsigned int min_length);
+    void open_suggestion_store(const std::string path);
+    void close_suggestion_store();
+    size_t populate_suggestion_store(const std::vector<std::string>& strs);
 };
 
 hfst_ospell::Transducer *createTransducer(std::string lex_path);
@@ -1,4 +1,4 @@
-%module py_hfst_ospell
+%module(threads="1") py_hfst_ospell
 
 %{
 #include "py-hfst-ospell.h"
@@ -13,6 +13,61 @@
 %template(ResVector) std::vector<std::string>;
 %template(ResWeightedPair) std::pair<std::string, float>;
 %template(ResWeightedVector) std::vector<std::pair<std::string, float>>;
+%template(BoolVector) std::vector<bool>;
+%template(ResVectorVector) std::vector<std::vector<std::string>>;
+%template(ResWeightedVectorVector) std::vector<std::vector<std::pair<std::string, float>>>;
 
 
+// Loading and searching release the GIL, so other Python threads may run
+// meanwhile, on the same Speller too: the setters, the caches, the known
+// forms and the suggestion store may all change while searches run, and
+// each search keeps the settings, known forms and store it started with.
+// The quick calls keep the GIL.
+%nothread;
+%thread Speller::Speller;
+%thread Speller::spell;
+%thread Speller::suggest;
+%thread Speller::suggest_weighted;
+%thread Speller::suggest_stream;
+%thread Suggestions::next;
+%thread Speller::suggest_within;
+%thread Speller::suggest_weighted_within;
+%thread Speller::spell_batch;
+%thread Speller::suggest_batch;
+%thread Speller::suggest_weighted_batch;
+%thread Speller::set_known_forms;
+%thread Speller::open_suggestion_store;
+%thread Speller::populate_suggestion_store;
+%thread Speller::prebuild_cache;
+%thread Speller::save_cache;
+%thread Speller::load_cache;
+%thread Speller::save_image;
+%thread Speller::lookup;
+%thread createTransducer;
+%thread lookup;
+%thread lookup2;
+
+%newobject Speller::suggest_stream;
+// Suggestions give their search context back to the speller when they go,
+// so they keep the speller alive
+%pythonappend Speller::suggest_stream %{
+    # the stream searches the speller's automata
+    val._speller = self
+%}
+%apply std::string *OUTPUT { std::string *correction };
+%apply float *OUTPUT { float *weight };
+
 %include "py-hfst-ospell.h"
+
+%extend Suggestions {
+%pythoncode %{
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        found, correction, weight = self.next()
+        if not found:
+            raise StopIteration
+        return correction, weight
+%}
+}